@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// client for the disk server started with ./disk -S <socket>
+// without -l it sends the commands from a file or stdin, pipelined, and prints what each one printed and its status
+// as they come back
+// with -l it is a load generator, keeping -d requests in flight and reporting the latency of each operation
+
+#define DEFAULT_SOCKET "disk.sock"
+#define BUFFER (64 * 1024)
+
+// connecting to the server listening at path, returns -1 if it is not there
+int connect_server (const char * path) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("The socket path is too long.\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    perror("Unable to connect to the server");
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// writing all len bytes of buf to fd
+int write_all (int fd, const char * buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// a response being taken apart as its bytes arrive, "<status> <length>\n" and then length bytes of output
+typedef struct response {
+  char head[32];                               // the status line read so far
+  size_t head_len;
+  uint64_t left;                               // output still to come once the status line is complete
+  int in_output;
+  int status;
+} response;
+
+// taking the bytes from *p up to end into response r, the output going to fd unless it is -1
+// returns 1 once r is complete, with *p just past it, and 0 if the bytes ran out first
+int response_next (response * r, const char ** p, const char * end, int fd) {
+  while (!r->in_output && *p < end) {
+    char ch = *(*p)++;
+    if (ch != '\n') {
+      if (r->head_len < sizeof(r->head) - 1) {
+        r->head[r->head_len++] = ch;
+      }
+      continue;
+    }
+    r->head[r->head_len] = '\0';
+    unsigned long long len = 0;
+    if (sscanf(r->head, "%d %llu", &r->status, &len) < 1) {
+      r->status = -1;                          // not a response the server sends
+    }
+    r->left = len;
+    r->in_output = 1;
+  }
+  if (!r->in_output) {
+    return 0;
+  }
+  size_t n = (size_t)(end - *p) < r->left ? (size_t)(end - *p) : r->left;
+  if (fd != -1 && n > 0) {
+    write_all(fd, *p, n);
+  }
+  *p += n;
+  r->left -= n;
+  if (r->left > 0) {
+    return 0;
+  }
+  r->head_len = 0;
+  r->in_output = 0;
+  return 1;
+}
+
+// counting the newlines in len bytes of buf
+uint64_t count_lines (const char * buf, size_t len) {
+  uint64_t lines = 0;
+  for (const char *p = buf; (p = memchr(p, '\n', buf + len - p)) != NULL; p++) {
+    lines++;
+  }
+  return lines;
+}
+
+// sending the commands read from in and copying the responses to stdout, returns the number of commands answered
+uint64_t forward (int sock, int in) {
+  char req[BUFFER + 1], resp[BUFFER];
+  size_t len = 0, off = 0;                     // request bytes read from in, and how many of them are sent
+  uint64_t sent = 0, answered = 0;             // lines sent and responses received
+  response r = {0};
+  int eof = 0;
+  char last = '\n';                            // last byte read, a final line without a newline still gets one
+  while (!eof || off < len || answered < sent) {
+    int want = !eof && off == len;             // reading more only once the last read has gone out
+    struct pollfd p[2] = {
+      {sock, POLLIN | (off < len ? POLLOUT : 0), 0},
+      {in, want ? POLLIN : 0, 0},
+    };
+    if (poll(p, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+    if (want && (p[1].revents & (POLLIN | POLLHUP))) {
+      ssize_t n = read(in, req, BUFFER);
+      if (n <= 0) {
+        eof = 1;
+        len = off = 0;
+        if (last != '\n') {
+          req[len++] = '\n';
+        }
+      } else {
+        len = n;
+        off = 0;
+        last = req[n - 1];
+      }
+      sent += count_lines(req, len);
+    }
+    if (p[0].revents & POLLOUT) {
+      ssize_t n = write(sock, req + off, len - off);
+      if (n == -1 && errno != EINTR) {
+        perror("Unable to send the commands");
+        break;
+      }
+      off += n > 0 ? n : 0;
+    }
+    if (p[0].revents & (POLLIN | POLLHUP)) {
+      ssize_t n = read(sock, resp, sizeof(resp));
+      if (n <= 0) {
+        break;                                 // the server went away
+      }
+      const char *at = resp;
+      while (response_next(&r, &at, resp + n, STDOUT_FILENO)) {
+        char status[16];
+        write_all(STDOUT_FILENO, status, sprintf(status, "%d\n", r.status));     // after what the command printed
+        answered++;
+      }
+    }
+  }
+  return answered;
+}
+
+// nanoseconds on the monotonic clock
+uint64_t now_ns () {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// ordering latencies for qsort
+int compare_latency (const void * a, const void * b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// running ops creates and deletes of empty files under /lg with depth requests in flight, returns -1 on a broken connection
+int load (int sock, uint64_t ops, int depth) {
+  uint64_t *sent_at = malloc(depth * sizeof(uint64_t));      // when each request in flight went out, by op number modulo depth
+  uint64_t *latency = malloc((ops > 0 ? ops : 1) * sizeof(uint64_t));
+  char *req = malloc((size_t)depth * 32);
+  if (sent_at == NULL || latency == NULL || req == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  char resp[BUFFER];
+  response r = {0};
+  const char *at = resp;
+  ssize_t got = 0;
+  if (write_all(sock, "CD /lg\n", 7) == -1) {
+    printf("Unable to set up the load.\n");
+    return -1;
+  }
+  while (!response_next(&r, &at, resp + got, -1)) {      // the directory may already be there
+    if ((got = read(sock, resp, sizeof(resp))) <= 0) {
+      printf("Unable to set up the load.\n");
+      return -1;
+    }
+    at = resp;
+  }
+
+  uint64_t next = 0, done = 0, failed = 0;     // ops sent and answered
+  uint64_t start = now_ns();
+  while (done < ops) {
+    size_t len = 0;
+    while (next < ops && next - done < (uint64_t)depth) {
+      int f = (next / 2) % 4096;               // every file is created and then deleted
+      len += sprintf(req + len, next % 2 == 0 ? "CR /lg/f%d 0\n" : "DL /lg/f%d\n", f);
+      sent_at[next % depth] = now_ns();
+      next++;
+    }
+    if (len > 0 && write_all(sock, req, len) == -1) {
+      perror("Unable to send the load");
+      return -1;
+    }
+    ssize_t n = read(sock, resp, sizeof(resp));
+    if (n <= 0) {
+      printf("The server went away.\n");
+      return -1;
+    }
+    uint64_t t = now_ns();
+    at = resp;
+    while (response_next(&r, &at, resp + n, -1)) {     // a response can span two reads
+      latency[done] = t - sent_at[done % depth];
+      failed += r.status != 0;
+      done++;
+    }
+  }
+  double seconds = (now_ns() - start) / 1e9;
+
+  qsort(latency, ops, sizeof(uint64_t), compare_latency);
+  printf("%llu ops with %d in flight, %llu failed: %.0f ops/sec \n", (unsigned long long)ops, depth,
+         (unsigned long long)failed, ops / seconds);
+  if (ops > 0) {
+    printf("latency p50 %.2f us, p99 %.2f us, p999 %.2f us, max %.2f us \n", latency[ops / 2] / 1e3,
+           latency[ops * 99 / 100] / 1e3, latency[ops * 999 / 1000] / 1e3, latency[ops - 1] / 1e3);
+  }
+  free(sent_at);
+  free(latency);
+  free(req);
+  return 0;
+}
+
+// main
+int main (int argc, char * argv[]) {
+  const char *path = DEFAULT_SOCKET;
+  uint64_t ops = 0;                            // operations to generate, 0 to forward commands instead
+  int depth = 1;                               // requests kept in flight by the load generator
+  int opt;
+  while ((opt = getopt(argc, argv, "S:l:d:")) != -1) {
+    switch (opt) {
+      case 'S': path = optarg; break;                             // server socket
+      case 'l': ops = strtoull(optarg, NULL, 10); break;          // load generator
+      case 'd': depth = atoi(optarg); break;                      // pipeline depth
+      default:
+        fprintf(stderr, "usage: %s [-S socket] [-l ops [-d depth] | commands | -]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (depth < 1) {
+    depth = 1;
+  }
+
+  int sock = connect_server(path);
+  if (sock == -1) {
+    return 1;
+  }
+  int status = 0;
+  if (ops > 0) {
+    status = load(sock, ops, depth);
+  } else {
+    const char *input = optind < argc ? argv[optind] : "-";
+    int in = strcmp(input, "-") == 0 ? STDIN_FILENO : open(input, O_RDONLY);
+    if (in == -1) {
+      perror("Unable to open the commands");
+      close(sock);
+      return 1;
+    }
+    forward(sock, in);
+    if (in != STDIN_FILENO) {
+      close(in);
+    }
+  }
+  close(sock);
+  return status == -1 ? 1 : 0;
+}
@@ -1,739 +1,5476 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
 #define FILENAME_MAXLEN 8  
-#define TOTAL_INODES 16
 #define TOTAL_BLOCKPTRS 8 
+#define MAX_DEPTH 64           // deepest path that can be parsed
+#define FS_MAGIC 0x53465331    // "SFS1", marks a formatted disk
+#define FS_VERSION 8        // 2 added the indirect block pointers, 3 packed directory entries, 4 the journal, 5 block reference counts, 6 subtree counts, 7 snapshots, 8 inline files and deduplication
+#define FS_HASHED_DIRS 1     // superblock flag, directories are open addressed hash tables of entries
+#define FS_DEDUP 2           // superblock flag, full data blocks with the same content are stored once
+#define INLINE_MAX 48        // bytes of content a file keeps in its inode instead of in a block
+
+// default geometry, the same disk the simulator always used
+#define DEFAULT_INODES 16
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_DISK_SIZE (128 * 1024)
+
+// status codes returned by the commands, a failed command leaves the file system as it was
+#define FS_OK 0
+#define FS_ENOENT 1          // a file or directory on the path does not exist
+#define FS_EEXIST 2          // the name is already taken
+#define FS_ENOSPC 3          // out of inodes or blocks
+#define FS_EISDIR 4          // the command only handles files
+#define FS_ENAMETOOLONG 5    // a name is longer than FILENAME_MAXLEN
+#define FS_EINVAL 6          // a malformed path, size or command
+#define FS_EIO 7             // the image could not be written
+
+// file content, the letters a to z over and over from the first byte of a file
+#define FILL_PERIOD 26
+#define FILL_SPAN (FILL_PERIOD * 160)   // bytes copied at a time, a whole number of periods and at least a 4K block
+
+// journal
+#define JOURNAL_MAGIC 0x4a524e4c   // "JRNL", the journal holds a committed transaction not yet checkpointed
+#define JOURNAL_MIN 8              // blocks the group commit fills on the smallest disk
+#define JOURNAL_MAX 4096           // and on the largest, a thirty second of the disk in between
+#define JOURNAL_SLACK 16           // directory, index and file blocks one command changes outside the metadata
+#define JOURNAL_ZERO 0x80000000u   // set in a logged block number when the block is all zeroes and has no copy in the log
+
+// block cache
+#define CACHE_CHUNK (64 * 1024)     // bytes cached and evicted together, a whole number of pages and of the largest block
+#define CACHE_READAHEAD 8           // chunks read ahead of a sequential scan
+#define CACHE_RESIDENT 1            // chunk state bits
+#define CACHE_REFERENCED 2
+
+// consistency check
+#define CHECK_INODES 4096           // inodes a checker thread claims at a time
+#define CHECK_BYTES (4 << 20)       // bytes of the block space a checker thread claims at a time
+#define CHECK_BAD 1                 // inode state bits, damaged so that a repair drops it and what is below it
+#define CHECK_REBUILD 2             // a directory whose entries have to be rewritten
+#define CHECK_VISITING 4            // on the chain of parents being followed
+#define CHECK_DONE 8                // known to be reached or not
+#define CHECK_REACHED 16            // reached from the root
+#define CHECK_INODE 0               // kinds of problems
+#define CHECK_STALE 1
+#define CHECK_ENTRY 2
+#define CHECK_ORPHAN 3
+#define CHECK_LEAK 4
+#define CHECK_UNMARKED 5
+#define CHECK_REFCOUNT 6
+#define CHECK_GARBAGE 7
+#define CHECK_SIZE 8
+#define CHECK_COUNTS 9
+#define CHECK_JOURNAL 10
+#define CHECK_SNAPSHOT 11
+#define CHECK_DEDUP 12
+#define CHECK_KINDS 13
+
+// snapshots
+#define MAX_SNAPSHOTS 8             // entries in the snapshot table after the superblock fields
+
+// deduplication
+#define DEDUP_RATIO 64              // blocks of the disk for each slot of the dedup table
+#define DEDUP_SEED 0xcbf29ce484222325ULL     // where the content hash of a block starts
+
+// tree listing
+#define LIST_PAGE 1000              // entries one LL of a tree prints before it hands back a cursor
+
+// batch engine
+#define MAX_ARGS 3                  // arguments a command can take
+#define BATCH_BUFFER (1 << 20)      // bytes of input read at a time, also the longest line accepted
+
+// server
+#define MAX_CLIENTS 64              // connections served at once
+#define CLIENT_BUFFER (64 * 1024)   // request bytes buffered per connection, also the longest line accepted
+
+// benchmark, the geometry used unless -n, -b or -s are given
+#define BENCH_OPS 20000             // commands generated per workload, changed with -c
+#define BENCH_INODES 262144
+#define BENCH_DISK_SIZE (512 * 1024 * 1024)
+#define BENCH_IMAGE "bench.img"
+
+// tracing
+// TRACE_LEVEL picks the most detailed trace compiled in, the release build sets 0 so every TRACE compiles to nothing
+// -v raises the level recorded at run time, one step per -v
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 0
+#endif
+#define TRACE_INFO 1         // one record for each command that changes the disk
+#define TRACE_DEBUG 2        // the steps inside a command
+#define TRACE_VERBOSE 3      // every directory on a path
+#define TRACE_ARGS 4         // arguments kept per record
+#define TRACE_RING (1 << 16) // records kept, the oldest are overwritten
+
+// statistics
+#define STAT_SLOTS 64        // threads that can keep statistics, each in its own slot
+#define MAX_COMMANDS 16      // entries the command table can have
+#define HIST_SHIFT 3
+#define HIST_SUB (1 << HIST_SHIFT)     // histogram buckets per power of two, so a bucket is at most 12.5% wide
+#define HIST_BUCKETS (62 * HIST_SUB)
+
+// concurrency
+#define INODE_LOCKS 1024     // directory lock stripes, inode k is guarded by lock k modulo INODE_LOCKS
+#define INDEX_LOCKS 256      // path index lock stripes, by bucket
+#define MAX_SHARDS 64        // most allocator shards a disk is split into
+#define SHARD_MIN_WORDS 16   // fewest bitmap words, 1024 blocks, in a shard
+#define MAX_WORKERS (STAT_SLOTS - 1)   // replay threads, each with its own statistics slot
 
 // inode
 typedef struct inode {
   int  dir;  // boolean value. 1 if it's a directory.
   char name[FILENAME_MAXLEN];
-  int  size;  // actual file/directory size in bytes.
+  int  below;  // files and directories anywhere under a directory, kept up to date like its size
+  int64_t size;  // actual file/directory size in bytes.
   int  blockptrs [TOTAL_BLOCKPTRS];  // direct pointers to blocks containing file's content.
   int  used;  // boolean value. 1 if the entry is in use.
-  int  rsvd;  // reserved for future use
+  int  parent;  // inode of the directory holding this entry, -1 for the root and unused entries
+  int  indirect;  // block of pointers to the file blocks after the direct ones, -1 if unused
+  int  dindirect;  // block of pointers to indirect blocks, -1 if unused
+  int  entries;  // number of entries in a directory
+  int  blocks;  // data blocks held, not counting index blocks
+  char data[INLINE_MAX];  // the content of a file of at most INLINE_MAX bytes, which holds no blocks, zeroes past its size
 } inode;
 
+// snapshot table entry
+// kept in block 0 after the superblock fields, a header of 0 marks a free entry
+typedef struct snapshot {
+  char name[FILENAME_MAXLEN];
+  uint32_t header;           // block holding the snapshot_header
+} snapshot;
+
+// snapshot header
+// a snapshot is a copy of the inode table, laid out in runs of blocks listed as start and count pairs after the header,
+// every block of the copy holds a whole number of inodes, and the blocks the inodes point at are shared with the disk
+typedef struct snapshot_header {
+  int64_t taken;             // seconds since the epoch
+  uint32_t free_inodes;      // the free counts of the superblock when it was taken, the geometry never changes
+  uint32_t free_blocks;
+  uint32_t table_blocks;     // blocks holding the copy
+  uint32_t runs;             // runs of blocks they are laid out in
+} snapshot_header;
+
 // superblock
+// block 0 of the disk, records the geometry chosen at format time and where each region starts
 typedef struct superblock {
-  char freeblocklist[128];       // assigning 128 bytes to the free block list in the superblock
-  inode inodes[TOTAL_INODES];    // for the 16 inodes in the superblock
+  uint32_t magic;            // FS_MAGIC once the disk is formatted
+  uint32_t version;          // layout version, FS_VERSION
+  uint32_t block_size;       // bytes in each block
+  uint32_t total_blocks;     // blocks on the disk, including the superblock, bitmap and inode table
+  uint32_t total_inodes;     // entries in the inode table
+  uint32_t bitmap_start;     // first block of the free block bitmap
+  uint32_t bitmap_blocks;
+  uint32_t refcount_start;   // first block of the reference counts, after the bitmap
+  uint32_t refcount_blocks;
+  uint32_t inode_start;      // first block of the inode table
+  uint32_t inode_blocks;
+  uint32_t data_start;       // first block that can hold file or directory data
+  uint32_t free_blocks;      // blocks not in use
+  uint32_t free_inodes;      // inodes not in use
+  uint32_t flags;            // FS_HASHED_DIRS, FS_DEDUP
+  uint32_t journal_start;    // first block of the journal, between the inode table and the data
+  uint32_t journal_blocks;
+  uint32_t dedup_start;      // first block of the dedup table, between the reference counts and the inode table
+  uint32_t dedup_blocks;     // 0 without FS_DEDUP
+  snapshot snapshots[MAX_SNAPSHOTS];
 } superblock;
 
+// journal
+// a sync is a transaction covering every command since the last one, and the blocks the committed disk does not
+// point at yet are written in place first, everything else is logged to the journal and only then written home
+// the header starts the first journal block, the logged block numbers follow it and the copies of the blocks come
+// after them, a crash before the header is complete leaves a checksum that does not match and the log is ignored
+typedef struct journal_header {
+  uint32_t magic;            // JOURNAL_MAGIC while a transaction waits to be written home
+  uint32_t count;            // blocks logged
+  uint64_t checksum;         // over the block numbers and the copies
+} journal_header;
+
+// dedup table entry
+// the table is open addressed by content hash with linear probing, and holds a reference to each block it names,
+// so a block in the table is never written in place and is freed once the table is the last to hold it
+typedef struct dedup_entry {
+  uint32_t hash;             // low half of the content hash of the block
+  uint32_t block;            // 0 for an empty slot, block 0 never holds data
+} dedup_entry;
+
 // directory entry
+// a directory's blocks are packed with these, a namelen of 0 marks an empty slot so fresh zeroed blocks are empty
 typedef struct dirent {
   char name[FILENAME_MAXLEN];
   int  namelen;  // length of entry name
   int  inode;  // this entry inode index
 } dirent;
 
-// datablock
-typedef struct datablock {
-  char index[1024];          // each index of datablock consists of 1024 bytes
-} datablock;
+// path index
+// hash of (parent inode, name) to child inode, so resolving a path costs one probe per component
+// the key of an entry is its own parent and name, so the index only has to keep the chains
+// after a mount the index starts out empty and is filled from the directories as they are looked at
+typedef struct pathindex {
+  int *head;                   // first inode chained in each bucket, -1 if the bucket is empty
+  int *next;                   // next inode chained in the same bucket
+  unsigned char *loaded;       // 1 once every entry of a linear directory is in the index
+  uint32_t *generation;        // bumped each time an inode is freed, so a walk can tell a reused number apart
+  unsigned int mask;           // number of buckets minus one, the bucket count is a power of two
+} pathindex;
 
-// helper functions
-// checking if the directory already exists
-int exists (char * directory, superblock * s) {
-  for (int i = 0; i < TOTAL_INODES; i++){                   // looping over each inode
-    if (strcmp((*s).inodes[i].name , directory) == 0) {     // checking if the name of the directory matches
-      return i;                                             // returning the inode number if the directory is found
-    }
-  }
-  return -1;        // if the directory does not exist in the inode table
-}
+// allocator shard
+// the bitmap is split into shards of whole words, each with its own lock and next-fit position,
+// so threads allocating at the same time mostly work in different shards
+typedef struct shard {
+  pthread_mutex_t lock;
+  uint32_t first;              // first block of the shard, a multiple of 64
+  uint32_t end;                // one past its last block, counting the padding bits past the end of the disk
+  uint32_t hint;               // next-fit position, the block after the last one handed out
+  uint32_t free;               // free blocks in the shard, so a full one is passed over without a scan
+} shard;
 
-// checking if all inodes are in use or not
-int check_space (superblock * s){
-  int left = -1;                                 // initially keeping it -1, it would change to 1 if there is space
-  for(int i = 0; i < TOTAL_INODES; i++){         // looping over each inode 
-    if ((*s).inodes[i].used == 0) {              // checking if that inode is in use
-      left = 1;                                  // if not in use then returning 1 to indicate that there is space left
-      break;
-    }
-  }
-  return left;
-}
+// release batch
+// while a thread has a batch, the blocks it frees are only cleared and collected, and go back to the bitmap and
+// the free count together when the batch is released, taking each shard lock once per run of blocks
+// inodes are counted as they are freed, before another thread can claim them
+typedef struct release_batch {
+  uint32_t * blocks;           // cleared blocks still marked used in the bitmap
+  uint32_t count;
+  uint32_t cap;
+} release_batch;
 
-// setting up the initial values for superblock and datablock
-void set_null (superblock * s, datablock * d_block[]){
-  for (int i = 0; i < TOTAL_INODES; i++) {
-    s->inodes[i].used = 0;                      // to indicate that inode is not in use
-    s->inodes[i].rsvd = 0;                      // to indicate that inode is not reserved
-    strcpy(s->inodes[i].name, "");              // initializing the name with empty string
-    s->inodes[i].dir = 0;                       // initially considering that it is not a directory, would change to 1 in case of a directory
-    s->inodes[i].size = 0;                      // initializing size with 0
-    for (int j = 0; j < TOTAL_BLOCKPTRS; j++){       // looping over each blockpointer of each inode
-      s->inodes[i].blockptrs[j] = -1;                // to indicate that the blockpointer is not pointing towards any index of the data block
-    }
-  }
+// the disk as the routines see it, every region points into the disk image
+// commands can run on many threads: a directory is changed only under its inode lock, the path index under its
+// bucket locks and the bitmap under its shard locks, while free counts and sizes change atomically
+typedef struct filesystem {
+  char * disk;                 // the whole disk image, mapped from the image file
+  int fd;                      // the image file
+  uint64_t map_size;           // bytes mapped
+  superblock * sb;             // geometry, read by every routine
+  uint64_t * freeblocklist;    // one bit per block of the disk, set if the block is in use
+  uint32_t * refcounts;        // references to each block beyond the first, so a block owned by one file counts 0
+  inode * inodes;              // the inode table
+  pathindex index;             // in-memory path index over the inode table
+  shard * shards;              // the block allocator
+  uint32_t nshards;
+  uint32_t shard_words;        // bitmap words in every shard but maybe the last
+  uint32_t inode_hint;         // where the search for a free inode starts
+  uint64_t * dirty;            // one bit per block changed since the last sync
+  uint32_t * dirty_list;       // the changed blocks, so a sync never has to scan the whole bitmap
+  uint32_t dirty_count;
+  uint32_t dirty_cap;
+  pthread_mutex_t dirty_lock;  // guards the dirty list, the bits are set atomically
+  uint64_t * fresh;            // one bit per block the committed disk does not point at, so it can be written in place
+  uint64_t * freed;            // one bit per block freed since the last sync that the committed disk still points at
+  uint32_t logged;             // changed blocks that will go through the journal
+  uint32_t group_commit;       // commands per transaction, 0 to commit only on SY, a full journal and unmount
+  uint32_t since_commit;       // commands run since the last commit
+  pthread_rwlock_t txn_lock;   // held shared by every command and exclusively by a commit
+  pthread_mutex_t rename_lock; // held while a directory moves to another parent, so two moves cannot make a cycle
+  pthread_rwlock_t tree_lock;  // held shared while sizes go up the parent chain, exclusively while a subtree is relinked
+  dedup_entry * dedup;         // the dedup table, NULL without FS_DEDUP
+  uint32_t dedup_mask;         // slots in the table minus one
+  uint32_t dedup_used;         // slots in use
+  uint64_t * pinned;           // one bit per block the dedup table holds
+  uint64_t pattern_hash[FILL_PERIOD];   // content hash of a full block of the fill pattern from each letter, with bit 32 set once known
+  pthread_mutex_t dedup_lock;  // recursive, guards the dedup table and the pinned bits while they change
+  uint8_t * cache;             // CACHE_RESIDENT and CACHE_REFERENCED for each chunk of the image
+  uint64_t cache_chunks;
+  uint64_t cache_first;        // first chunk holding nothing but data, the ones before it are never evicted
+  uint64_t cache_capacity;     // chunks the cache may hold, 0 for no limit
+  uint64_t cache_resident;     // chunks resident now
+  uint64_t cache_hand;         // the CLOCK hand
+  pthread_mutex_t inode_locks[INODE_LOCKS];    // recursive, a thread may take a directory it already holds
+  pthread_mutex_t index_locks[INDEX_LOCKS];
+} filesystem;
 
-  s->freeblocklist[0] = '1';              // the first element of freeblock list is occupied since it is the superblock
-  for (int i = 1; i < 128; i++){          // looping over the entire freeblocklist except for its first index
-    s->freeblocklist[i] = '0';            // to indicate that index of datablock are initially not in use
-    for (int j = 0; j < 1024; j++) {
-      d_block[i-1]->index[j] = '\0';      // setting each index of datablock to \0
-    }                                     // i-1 because the indexes 1-127 of freeblocklist represent the indexes 0-126 of the datablock
-  }
+// trace record
+// the format is not expanded when the record is made, names are packed into an argument and numbers are kept as they are
+typedef struct trace_record {
+  const char * fmt;            // printf style, %s takes a name packed by trace_name, everything else is an integer
+  int level;
+  int nargs;
+  int64_t args[TRACE_ARGS];
+} trace_record;
+
+int trace_verbosity = 0;                       // the most detailed level recorded, raised by -v
+trace_record trace_ring[TRACE_RING];
+uint64_t trace_head = 0;                       // records made so far, the next one goes at trace_head modulo TRACE_RING
+
+// statistics
+// a latency histogram per command and counters of the work done inside the commands
+// every thread counts into its own slot, so counting needs no locks, and the slots are added up when reported
+typedef struct stats {
+  uint64_t hist[MAX_COMMANDS][HIST_BUCKETS];   // nanoseconds each run of a command took
+  uint64_t errors[MAX_COMMANDS];               // runs that returned a status other than FS_OK
+  uint64_t total_ns[MAX_COMMANDS];
+  uint64_t inodes_scanned;                     // inode table entries looked at to find a free one
+  uint64_t blocks_scanned;                     // bitmap bits looked at to find free blocks
+  uint64_t ancestors_walked;                   // directories whose size was updated
+  uint64_t bytes_zeroed;                       // freed blocks cleared and metadata cleared by format
+  uint64_t bytes_written;                      // file content written by the commands
+  uint64_t bytes_read;                         // file content read by the commands
+  uint64_t bytes_synced;                       // bytes written back to the image file
+  uint64_t commits;                            // transactions committed
+  uint64_t bytes_journaled;                    // bytes logged to the journal before going home
+  uint64_t cache_hits;                         // data blocks looked at in a resident chunk
+  uint64_t cache_misses;                       // and in a chunk that had to be paged in
+  uint64_t cache_readahead;                    // chunks read ahead of a sequential scan
+  uint64_t cache_evictions;                    // chunks dropped to keep the cache within its capacity
+  uint64_t bytes_inline;                       // file content kept in inodes instead of blocks
+  uint64_t dedup_hits;                         // full blocks shared through the dedup table instead of stored again
+  uint64_t dedup_misses;                       // full blocks whose content the table did not have
+  uint64_t dedup_evictions;                    // blocks freed once only the table held them
+} stats;
+
+stats stat_slots[STAT_SLOTS];
+_Thread_local int my_slot = 0;                       // the running thread, 0 for the main thread and 1 up for workers
+_Thread_local stats * my_stats = &stat_slots[0];     // its statistics slot
+_Thread_local release_batch * my_batch = NULL;      // where the thread's frees are collected, NULL to free at once
+
+#define STAT(counter, n) (my_stats->counter += (n))
+
+// recording a trace record when both the build and the run ask for its level
+#define TRACE(level, fmt, ...) do { \
+    if ((level) <= TRACE_LEVEL && (level) <= trace_verbosity) { \
+      int64_t trace_args[] = {0, ##__VA_ARGS__}; \
+      trace_emit((level), (fmt), trace_args + 1, sizeof(trace_args) / sizeof(int64_t) - 1); \
+    } \
+  } while (0)
+
+// tracing
+
+// adding a record to the trace ring
+void trace_emit (int level, const char * fmt, int64_t * args, int nargs) {
+  trace_record *r = &trace_ring[__atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED) % TRACE_RING];
+  r->fmt = fmt;
+  r->level = level;
+  r->nargs = nargs < TRACE_ARGS ? nargs : TRACE_ARGS;
+  memcpy(r->args, args, r->nargs * sizeof(int64_t));
 }
 
-//checking for index with no data in data blocks
-int data_index (superblock * s){
-  for (int i = 1; i < 128; i++){            // i starting from 1 since d_block[0] contains super block
-    if (s->freeblocklist[i] == '0') {       // finding the index of freeblocklist which is not used
-      return i-1;                           // returning index of datablock
-    }
-  }
-  return -1;                                // in case all indexes of freeblocklist are in use
+// packing the first FILENAME_MAXLEN characters of a name into a trace argument
+int64_t trace_name (const char * name) {
+  int64_t packed = 0;
+  memcpy(&packed, name, strnlen(name, FILENAME_MAXLEN));
+  return packed;
 }
 
-//checking for index with no data in block pointers of inodes
-int block_index (inode j){
-  for (int i = 0; i < TOTAL_BLOCKPTRS; i++){       // looping over all blockpointers of the given inode
-    if (j.blockptrs[i] == -1) {                    // checking if they are not in use
-      return i;                                    // returning the index of the blockpointer which is not in use
+// printing the records in the trace ring to out, oldest first
+void trace_dump (FILE * out) {
+  uint64_t first = trace_head > TRACE_RING ? trace_head - TRACE_RING : 0;
+  if (trace_head > first) {
+    fprintf(out, "trace: %llu records, the last %llu kept \n", (unsigned long long)trace_head, (unsigned long long)(trace_head - first));
+  }
+  for (uint64_t n = first; n < trace_head; n++) {
+    trace_record *r = &trace_ring[n % TRACE_RING];
+    int a = 0;
+    for (const char *f = r->fmt; *f != '\0'; f++) {
+      if (*f != '%') {
+        fputc(*f, out);
+        continue;
+      }
+      f += strspn(f + 1, "-+ #0123456789.hlzjt") + 1;     // skipping to the conversion, the record keeps no widths
+      int64_t v = a < r->nargs ? r->args[a++] : 0;
+      if (*f == 's') {
+        char name[FILENAME_MAXLEN + 1] = {0};
+        memcpy(name, &v, FILENAME_MAXLEN);
+        fputs(name, out);
+      } else if (*f == '%') {
+        fputc('%', out);
+        a--;
+      } else if (*f == '\0') {
+        break;
+      } else {
+        fprintf(out, "%lld", (long long)v);
+      }
     }
   }
-  return -2;                                       // in case all the indexes of the blockpointers are in use
+  trace_head = 0;
 }
 
-//functions
-// create file
-void createfile (char * filename, char * filesize, superblock * s, datablock * d_block[]) {
-  // creating a path array that contains each directory or file from the abosulute path 
-  char *path[TOTAL_BLOCKPTRS];                // 8 is the longest path there could be since there are only 8 blockpointers for each inode
-  char *single = strtok(filename, "/");       // separating the directories or files with '/'
-  int i = 0;
+// block cache
+// the data region is cached in chunks of CACHE_CHUNK bytes, each with a resident and a referenced bit, so the
+// pages of the mapping in use can be bounded however large the image is
+// a chunk is resident from the first time a block in it is looked at until it is evicted, a look at a resident chunk
+// is a hit and anything else a miss, and a miss right after the chunk before it was used reads the next ones ahead
+// eviction only happens at the end of a commit, when nothing is dirty and no command is running, so every chunk a
+// command is using stays pinned until the command is done: a CLOCK hand passes over the chunks, giving a referenced
+// chunk a second chance and dropping the pages of the rest, which are paged back in from the image file when needed
+// the superblock, bitmap, reference counts, inode table and journal stay resident
 
-  while (single != NULL) {
-    path[i++] = single;              // adding all directories or files in the path
-    single = strtok(NULL, "/");      
+// reading ahead the chunks after chunk c that are not resident yet
+void cache_readahead (filesystem * s, uint64_t c) {
+  uint64_t n = 0;
+  while (n < CACHE_READAHEAD && c + n < (*s).cache_chunks &&
+         !(__atomic_fetch_or(&(*s).cache[c + n], CACHE_RESIDENT, __ATOMIC_RELAXED) & CACHE_RESIDENT)) {
+    n++;                                              // left unreferenced, so the hand takes them first if they go unused
   }
-
-  if(strlen(path[i-1]) > FILENAME_MAXLEN) {                       // path[i-1] is the name of the file to be created
-    printf("Name of the file cannot exceed 8 characters.\n");     // exiting if length of the name exceeds 8 characters
-    exit(1);
+  if (n > 0) {
+    madvise((*s).disk + c * CACHE_CHUNK, n * CACHE_CHUNK, MADV_WILLNEED);
+    __atomic_add_fetch(&(*s).cache_resident, n, __ATOMIC_RELAXED);
+    STAT(cache_readahead, n);
   }
+}
 
-  if(exists(path[i-1],s) != -1) {
-    printf("The file already exists.\n");
-    exit(1);                                       // exiting if the file already exists in the inode table
+// counting a look at block b as a hit or a miss
+void cache_touch (filesystem * s, uint32_t b) {
+  uint64_t c = (uint64_t)b * (*s).sb->block_size / CACHE_CHUNK;
+  if (c < (*s).cache_first) {
+    return;                                           // metadata, always resident
   }
-
-  int value = i;
-  int size = atoi(filesize);          // converting the size to integer
-  char * block[size];                 // making block with length filesize
-  for (int m = 0; m < size; m++) {
-    block[m] = '\0';                  // initializing each index of the block with '\0'
+  uint8_t state = __atomic_load_n(&(*s).cache[c], __ATOMIC_RELAXED);
+  if (state == (CACHE_RESIDENT | CACHE_REFERENCED) ||
+      (__atomic_fetch_or(&(*s).cache[c], CACHE_RESIDENT | CACHE_REFERENCED, __ATOMIC_RELAXED) & CACHE_RESIDENT)) {
+    STAT(cache_hits, 1);
+    return;
   }
-
-  char *alphabets[26];               // making an array pointing to characters a-z
-  for (int u = 0; u < 26; u++) {
-    char letter[2];
-    letter[0] = 'a' + u;            // to get the next alphabet
-    letter[1] = '\0';               // null-terminating the string
-    alphabets[u] = (char *)malloc(2 * sizeof(char));     // allocating alphabets on heap         
-    if (alphabets[u] == NULL) {
-      perror("malloc");                                  // in case of memory allocation failure
-      exit(1);
-    }
-    strcpy(alphabets[u], letter);    // putting the alphabet into the alphabet array
+  STAT(cache_misses, 1);
+  __atomic_add_fetch(&(*s).cache_resident, 1, __ATOMIC_RELAXED);
+  if (c > (*s).cache_first && (__atomic_load_n(&(*s).cache[c - 1], __ATOMIC_RELAXED) & CACHE_REFERENCED)) {
+    cache_readahead(s, c + 1);                        // a sequential scan, of a file or a directory
   }
+}
 
-  int previous = -1;    // variable used to keep track of the inode of the previous directory
-
-  for (int j = 0; j < i; j++) {                                       // looping over each index of path
-    printf("Element in create file: %d: %s\n", j, path[j]);           // to print the current element of the path
-    printf("Parent value in create file: %d \n", exists(path[j],s));     // checking if this already exists in the inode table
-    int parent = -1;                  // initially considering that it does not exist
-    parent = exists(path[j],s);       // parent will contain the inode number if it does exist
-
-    for (int k = 0; k < TOTAL_INODES; k++){       // looping over each inode
-      if ((*s).inodes[k].used == 0) {             // k will be the inode number which is not used 
-
-        if (previous != -1 && parent == -1){       // if the previous element is the parent of the current element and the current element does not already exist
-          if (path[j] != path[i-1]) {
-            printf("The directory %s at the given path does not exist.\n", path[j]);    // error checking for wrong path
-            exit(1);
-          }
-          int d_index = data_index(s);                                      // finding the index of the datablock which is not in use
-          printf ("this is d_index in create file: %d \n", d_index);
-          int b_index = block_index((*s).inodes[previous]);                 // finding the index of the blockpointer of the inode which is not in use
-          printf("Name of previous here: %d \n", previous);
-          printf ("this is b_index in create file: %d \n", b_index);
-          if (d_index != -1 && b_index != -2) {                         // if there is space both in the datablock and the blockpointers
-            char inode_num[20];                                         // converting the inode number to char to put it into the datablock
-            sprintf(inode_num, "%d", k);
-            inode_num[strlen(inode_num)] = '\0';                        // null-terminating 
-            printf("this is converted to char: %s \n", inode_num);
-            strcpy(d_block[d_index]->index , inode_num);                // putting the inode number into the index of the datablock
-            (*s).freeblocklist[d_index + 1] = '1';                      // changing the status of the freeblocklist
-            (*s).inodes[previous].blockptrs[b_index] =  d_index;        // the parent of the current directory is pointing towards the datablock index that has inode number of current directory
-            printf("%d",(*s).inodes[previous].blockptrs[b_index]);
-            printf(" is the value stored in the blockpointer %d of inode %d in create file\n", b_index, previous);
-          } else if(d_index == -1) {
-            printf ("No Space left in the data block.\n");      // exiting if no space in the datablock
-            exit(1);
-          } else if(b_index == -2) {
-            printf("All 8 blockpointers of the file is pointing towards some data indes.\n");        // exiting if no space in the blockpointer
-            exit(1);
-          }
-        }
-
-        // changing the attributes if the inode does not already exist
-        if (parent == -1) {
-          (*s).inodes[k].used = 1;
-          (*s).inodes[k].dir = 0;
-          strcpy((*s).inodes[k].name, path[j]);
-          (*s).inodes[k].size = atoi(filesize);
-          (*s).inodes[k].rsvd = 0;
-
-          // changing the size of the directories in the path in accordance with the size of the file
-          int the_inode = k;                                 // current inode
-          for (int index = 0; index < value; index++){       // looping through all the previous elements of the current inode in the path
-            int escape = 0;                                  // variable to keep track of when to exit the outer loop
-            int data_index;                                 
-            for (int g = 0; g < TOTAL_INODES; g++){
-              for (int h = 0; h < TOTAL_BLOCKPTRS; h++){
-                data_index = (*s).inodes[g].blockptrs[h];               // finding the index of the data block of each of the block pointers of each inode     
-                if (atoi(d_block[data_index]->index) == the_inode){     // if the inode in that datablock matches the current inode then it means we found its parent
-                  (*s).inodes[g].size = (*s).inodes[g].size + atoi(filesize);      // changing the size of the parent
-                  printf("this is the size of %s: %d \n", (*s).inodes[g].name, (*s).inodes[g].size);
-                  the_inode = g;           // current inode becomes the parent inode so that we can change size recursively
-                  escape = 1;              // changing its value to indicate that we need to exit the outerloop
-                  break;
-                }
-              }
-              if (escape == 1){
-                break;                // exiting the outerloop
-              }
-            }
-          }
-
-          // filling the block array with alphabets
-          for (int i = 0; i < size; i++) {
-            block[i] = (char *)malloc(strlen(alphabets[i % 26]) + 1);     // allocating block on heap
-            strcpy(block[i], alphabets[i % 26]);                          // copying the string
-          }
-
-          int f_index = data_index(s);       // finding the index to store alphabets in the datablock
-          printf ("this is the free index for storing alphabets in create file: %d \n", f_index);
-          if (f_index == -1){
-            printf("No space left in the data block.\n");
-            exit(1);                                          // exiting if there is no space to add alphabets in the datablock
-          }
-
-          for (int b = 0; b < size; b++) {
-            d_block[f_index]->index[b] = *block[b];     // adding block to the datablock
-            free(block[b]);                             // free the memory on heap for block
-          }
-          for (int v = 0; v < 26; v++) {
-            free(alphabets[v]);                         // free the memory on heap for alphabets
-          }
+// checking if the cache holds more chunks than it may
+int cache_full (filesystem * s) {
+  return (*s).cache_capacity > 0 && __atomic_load_n(&(*s).cache_resident, __ATOMIC_RELAXED) > (*s).cache_capacity;
+}
 
-          int fblock_index = block_index((*s).inodes[k]);       // finding the index of blockpointer of the current inode 
-          (*s).inodes[k].blockptrs[fblock_index] = f_index;     // blockpointer stores the index of the datablock with alphabets corresponding to the filesize
-          printf("the block index %d of the inode %s contains: %d \n", fblock_index, (*s).inodes[k].name, (*s).inodes[k].blockptrs[fblock_index]);
-          (*s).freeblocklist[f_index + 1] = '1';                // to indicate that this index of datablock is in use
-          printf("data block[%d] contains: %s \n", f_index, d_block[f_index]->index);
-          break;
-        }
-      }
+// evicting chunks until an eighth of the capacity is free again, only while nothing is dirty
+void cache_evict (filesystem * s) {
+  uint64_t target = (*s).cache_capacity - (*s).cache_capacity / 8;
+  uint64_t span = (*s).cache_chunks - (*s).cache_first;
+  for (uint64_t seen = 0; (*s).cache_resident > target && seen < 2 * span; seen++) {    // two passes clear every referenced bit
+    uint64_t c = (*s).cache_hand;
+    (*s).cache_hand = c + 1 < (*s).cache_chunks ? c + 1 : (*s).cache_first;
+    if (!((*s).cache[c] & CACHE_RESIDENT)) {
+      continue;
     }
+    if ((*s).cache[c] & CACHE_REFERENCED) {
+      (*s).cache[c] = CACHE_RESIDENT;                 // a second chance
+      continue;
+    }
+    uint64_t len = (*s).map_size - c * CACHE_CHUNK < CACHE_CHUNK ? (*s).map_size - c * CACHE_CHUNK : CACHE_CHUNK;
+    madvise((*s).disk + c * CACHE_CHUNK, len, MADV_DONTNEED);    // the private pages go, the image file has the same bytes
+    (*s).cache[c] = 0;
+    (*s).cache_resident--;
+    STAT(cache_evictions, 1);
+  }
+}
 
-    previous = parent;     // previous will remain -1 if the current inode is not a parent, otherwise will contain the inode number of the parent
-    parent = -1;           // changing its value to -1 for the next iteration
+// setting up the cache for a freshly mapped image, with no limit until cache_limit is called
+void cache_reset (filesystem * s) {
+  free((*s).cache);
+  (*s).cache_chunks = ((*s).map_size + CACHE_CHUNK - 1) / CACHE_CHUNK;
+  (*s).cache = calloc((*s).cache_chunks, 1);
+  if ((*s).cache == NULL) {
+    perror("calloc");
+    exit(1);
   }
+  (*s).cache_first = ((uint64_t)(*s).sb->data_start * (*s).sb->block_size + CACHE_CHUNK - 1) / CACHE_CHUNK;
+  (*s).cache_hand = (*s).cache_first;
+  (*s).cache_resident = 0;
+  (*s).cache_capacity = 0;
 }
 
-// copy file
-void copyfile (char * sourcefile, char * destfile, superblock * s, datablock * d_block[]){
-  char *path[TOTAL_BLOCKPTRS];                   
-  char *single = strtok(sourcefile, "/");
-  int i = 0;
+// keeping at most bytes of data resident, or any amount if it is 0
+// the kernel's own readahead and fault-around are turned off, they would map pages the cache does not count
+void cache_limit (filesystem * s, uint64_t bytes) {
+  (*s).cache_capacity = (bytes + CACHE_CHUNK - 1) / CACHE_CHUNK;
+  if (bytes > 0) {
+    madvise((*s).disk, (*s).map_size, MADV_RANDOM);
+  }
+}
 
-  while (single != NULL) {
-    path[i++] = single;
-    single = strtok(NULL, "/");
+// helper functions
+// address of block b in the disk image
+char * block_at (filesystem * s, uint32_t b) {
+  if ((*s).cache != NULL) {
+    cache_touch(s, b);
   }
+  return (*s).disk + (uint64_t)b * (*s).sb->block_size;
+}
 
-  int s_size;                                               // variable to store the size of the file
-  for (int k = 0; k < TOTAL_INODES; k++) {
-    if (strcmp((*s).inodes[k].name,path[i-1]) == 0) {       // finding the inode of the file to be copied
-      if((*s).inodes[k].dir == 1) {
-        printf("Can not handle directories.\n");
+// dirty tracking
+// the image is mapped privately, so a change only reaches the file once its block is written back by sync_disk
+// every routine that changes the image marks the bytes it changed
+
+// marking the blocks holding the len bytes at p as changed
+void mark_dirty (filesystem * s, void * p, uint64_t len) {
+  uint32_t bs = (*s).sb->block_size;
+  uint64_t first = ((char *)p - (*s).disk) / bs;
+  uint64_t last = ((char *)p - (*s).disk + len - 1) / bs;
+  for (uint64_t b = first; b <= last; b++) {
+    uint64_t bit = (uint64_t)1 << (b % 64);
+    if ((__atomic_load_n(&(*s).dirty[b / 64], __ATOMIC_RELAXED) & bit) ||
+        (__atomic_fetch_or(&(*s).dirty[b / 64], bit, __ATOMIC_RELAXED) & bit)) {
+      continue;                                       // already waiting for the next sync
+    }
+    pthread_mutex_lock(&(*s).dirty_lock);             // only the thread that set the bit adds the block to the list
+    if ((*s).dirty_count == (*s).dirty_cap) {
+      (*s).dirty_cap = (*s).dirty_cap ? (*s).dirty_cap * 2 : 1024;
+      (*s).dirty_list = realloc((*s).dirty_list, (*s).dirty_cap * sizeof(uint32_t));
+      if ((*s).dirty_list == NULL) {
+        perror("realloc");
         exit(1);
       }
-      s_size = (*s).inodes[k].size;                         // storing its size
-      break;
+    }
+    (*s).dirty_list[(*s).dirty_count++] = b;
+    pthread_mutex_unlock(&(*s).dirty_lock);
+    if (!(__atomic_load_n(&(*s).fresh[b / 64], __ATOMIC_RELAXED) & bit)) {
+      __atomic_add_fetch(&(*s).logged, 1, __ATOMIC_RELAXED);      // counting towards a full journal
     }
   }
-  printf("this is the size of source file: %d \n", s_size);
-  char str_size[32];                
-  sprintf(str_size, "%d", s_size);               // changing the data type of size to pass it into the create file function
-  printf("converted size %s \n", str_size);
-  createfile(destfile, str_size, s, d_block);    // the create file function creates a copy                                 
 }
 
-// remove/delete fileed
-void removefile (char * file, superblock * s, datablock * d_block[]) {
-  char *path[TOTAL_BLOCKPTRS];             
-  char *single = strtok(file, "/");
-  int i = 0;
-
-  while (single != NULL) {
-    path[i++] = single;
-    single = strtok(NULL, "/");
-  }
-
-  char * filename = path[i-1];
-  printf("this is the filename: %s \n", filename);
+// marking inode k as changed
+void inode_dirty (filesystem * s, int k) {
+  mark_dirty(s, &(*s).inodes[k], sizeof(inode));
+}
 
-  if (exists(filename, s) == -1){
-    printf("The file does not exist.\n");        // error checking in case the file does not exist
-    exit(1);
-  }
+// ordering block numbers for qsort
+int compare_blocks (const void * a, const void * b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
 
-  int value = i;
-  int file_inode;                                       
-  for (int i = 0; i < TOTAL_INODES; i++){
-    if (strcmp((*s).inodes[i].name, filename) == 0){       // finding the inode of the file to be deleted
-      file_inode = i;                                      // storing the inode number
-      break;
+// writing len bytes of buf to the image file at offset, retrying short writes
+int write_at (filesystem * s, const void * buf, uint64_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite((*s).fd, buf, len, offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
     }
-  }
-  printf("this is the file inode: %d \n", file_inode); 
-  int filesize = (*s).inodes[file_inode].size;             // storing the filesize of the current inode
-
-  //subtracting directory size in accordance with the file to be deleted
-  int the_inode = file_inode;  
-  int escape = 0;                    
-  for (int index = 0; index < value; index++){     // looping over all of the parents of file to be deleted
-    int data_index;
-    for (int g = 0; g < TOTAL_INODES; g++){
-      for (int h = 0; h < TOTAL_BLOCKPTRS; h++){
-        data_index = (*s).inodes[g].blockptrs[h];                 // finding the index of the data block of each of the block pointers of each inode     
-        if (atoi(d_block[data_index]->index) == the_inode){       // if the index of datablock contains the current inode it means we have found the parent
-          (*s).inodes[g].size = (*s).inodes[g].size - filesize;   // changing the size of the parent
-          printf("this is the size of %s: %d \n", (*s).inodes[g].name, (*s).inodes[g].size);
-          the_inode = g;       // changing the current inode for next iteration
-          escape = 1;
-          break;
-        }
-      }
-      if (escape == 1){
-        break;               // exiting the outerloop
-      }
+    if (n <= 0) {
+      return -1;
     }
+    buf = (const char *)buf + n;
+    offset += n;
+    len -= n;
   }
+  return 0;
+}
 
-  if (escape == 0){      // escape would only be 0 if we did not find the parent
-    printf("The directory at the given path does not exist.\n");       // parent not found means that there is incorrect path given
-    exit(1);
-  }
-
-  int leave = 0;
-  int data_index;
-  for (int i = 0; i < TOTAL_INODES; i++){
-    for (int j = 0; j < TOTAL_BLOCKPTRS; j++){
-      data_index = (*s).inodes[i].blockptrs[j];    // finding the index of the data block of each of the block pointers of each inode     
-      if (atoi(d_block[data_index]->index) == file_inode){
-        printf("this is the data index which contains the inode: %d \n", data_index);
-        printf("name of parent inode: %s and its blockpointer: %d \n", (*s).inodes[i].name, j);
-        for (int l = 0; l < 1024; l++) {
-          d_block[data_index]->index[l] = '\0';      // copy '\0' to each element of the datablock index
-        }
-        (*s).freeblocklist[data_index + 1] = '0';    // to show that this index of datablock is available for some other data
-        (*s).inodes[i].blockptrs[j] = -1;            // to indicate that this index of the blockpointer of the inode is no longer pointing to a datablock index  
-	      leave = 1;
-        break;
-      }
+// writing the count sorted blocks of list to where they belong in the image file, with runs of neighbouring blocks
+// going out in one pwrite, returns the number of writes or -1
+int64_t write_home (filesystem * s, uint32_t * list, uint32_t count) {
+  uint32_t bs = (*s).sb->block_size;
+  int64_t writes = 0;
+  for (uint32_t i = 0; i < count; ) {
+    uint32_t j = i + 1;
+    while (j < count && list[j] == list[j-1] + 1) {
+      j++;                                            // extending the run while the blocks are adjacent
     }
-
-    if (leave == 1){
-      break;
+    if (write_at(s, block_at(s, list[i]), (uint64_t)(j - i) * bs, (uint64_t)list[i] * bs) == -1) {
+      return -1;
     }
+    STAT(bytes_synced, (uint64_t)(j - i) * bs);
+    writes++;
+    i = j;
   }
+  return writes;
+}
 
-  int d_block_index;
-  for (int k = 0; k < TOTAL_BLOCKPTRS; k++){
-    if ((*s).inodes[file_inode].blockptrs[k] != -1){              // checking if the block pointers of the file to be deleted are pointing towards any data block index
-      printf("this is the file inode: %d \n", file_inode);
-      d_block_index = (*s).inodes[file_inode].blockptrs[k];       // if they are pointing towards some index then storing that index
-      printf("this is the data block index with data from file1: %d\n", d_block_index);
-      for (int l = 0; l < 1024; l++) {
-        d_block[d_block_index]->index[l] = '\0'; // Copy "" to each element of the index array
-      }
-      printf("datablock[%d] contains: %s \n", d_block_index, d_block[d_block_index]->index);
-      (*s).freeblocklist[d_block_index + 1] = '0';                // updating the freeblocklist index to show that it is available for some other data
-      (*s).inodes[file_inode].blockptrs[k] = -1;                  // setting the blockpointer of the file to be deleted to -1 so that it does not point towards any data index
+// checking if block b holds nothing but zeroes
+int block_zero (filesystem * s, uint32_t b) {
+  uint64_t *w = (uint64_t *)block_at(s, b);
+  for (uint32_t i = 0; i < (*s).sb->block_size / sizeof(uint64_t); i++) {
+    if (w[i] != 0) {
+      return 0;
     }
   }
+  return 1;
+}
 
-  // setting all the values of that inode 
-  (*s).inodes[file_inode].used = 0;
-  (*s).inodes[file_inode].rsvd = 0;
-  strcpy(s->inodes[file_inode].name, "");
-  (*s).inodes[file_inode].dir = 0;
-  (*s).inodes[file_inode].size = 0;
-
-  
+// hashing len bytes into the running checksum h
+uint64_t journal_sum (uint64_t h, const void * p, uint64_t len) {
+  const uint64_t *w = p;                              // blocks and block number lists are always whole words
+  for (uint64_t i = 0; i < len / sizeof(uint64_t); i++) {
+    h = (h ^ w[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
 
+// blocks taken by the header and count logged block numbers
+uint32_t journal_head_blocks (uint32_t block_size, uint32_t count) {
+  uint64_t bytes = sizeof(journal_header) + (uint64_t)(count + 1) / 2 * 2 * sizeof(uint32_t);     // padded to whole words
+  return (bytes + block_size - 1) / block_size;
 }
 
-// move a file
-void movefile (char * source, char * destination, superblock * s, datablock * d_block[]) {
-  // parsing the source 
-  char *path[8];                              
-  char *single = strtok(source, "/");
-  int i = 0;
+// blocks kept free in the journal for the command that fills it, enough for a copy of every block before the
+// journal, which an SR, a large DD or a repair can all change, the number of every block on the disk and some slack
+uint64_t journal_reserve (uint64_t blocks, uint32_t block_size, uint64_t metadata_blocks) {
+  return metadata_blocks + journal_head_blocks(block_size, blocks) + JOURNAL_SLACK;
+}
 
-  while (single != NULL) {
-    path[i++] = single;
-    single = strtok(NULL, "/");
+// blocks the commands of a transaction can log before it is committed, the rest of the journal is the reserve
+uint32_t journal_room (filesystem * s) {
+  uint64_t reserve = journal_reserve((*s).sb->total_blocks, (*s).sb->block_size, (*s).sb->journal_start);
+  if ((*s).sb->journal_blocks <= reserve) {
+    return (*s).sb->journal_blocks / 2;               // formatted before the journal kept a reserve
   }
+  return (*s).sb->journal_blocks - reserve;
+}
 
-  // parsing the destination
-  char *path2[8];                              
-  char *single2 = strtok(destination, "/");
-  int m = 0;
-
-  while (single2 != NULL) {
-    path2[m++] = single2;
-    single2 = strtok(NULL, "/");
+// logging the count sorted blocks of list to the journal, a copy for each unless it is all zeroes, returns -1 if the
+// image could not be written and 1 if they do not fit
+int journal_write (filesystem * s, uint32_t * list, uint32_t count) {
+  uint32_t bs = (*s).sb->block_size;
+  uint32_t copies = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (block_zero(s, list[i])) {
+      list[i] |= JOURNAL_ZERO;                        // a freed block, recorded without a copy
+    } else {
+      copies++;
+    }
   }
-
-  int num;  // to store the inode of the file
-  for (int k = 0; k < TOTAL_INODES; k++) {                             
-    if (strcmp((*s).inodes[k].name,path[i-1]) == 0) {      // finding the inode of the file to be moved
-      num = k;
-      break;
+  uint32_t head = journal_head_blocks(bs, count);
+  if (head + copies > (*s).sb->journal_blocks) {
+    for (uint32_t i = 0; i < count; i++) {
+      list[i] &= ~JOURNAL_ZERO;
     }
+    return 1;
   }
-
-  if((*s).inodes[num].dir == 1) {
-    printf("Can not handle directories.\n");    // since we have to move only files
+  char *buf = calloc(head, bs);
+  if (buf == NULL) {
+    perror("calloc");
     exit(1);
   }
-
-  int parent;                                     // to store the inode of parent of the file to be moved
-  for (int l = 0; l < TOTAL_INODES; l++) {
-    if (exists(path[i-2], s) == -1) {
-      printf("The directory %s at the source path does not exist.\n", path[i-2]);      // in case of invalid path in the source 
-      return;
-    } else if (strcmp((*s).inodes[l].name,path[i-2]) == 0) {     // finding the previous parent of the file to be moved
-      parent = l;
-      printf("found: %s \n", s->inodes[parent].name);
-      break;
+  journal_header *h = (journal_header *)buf;
+  uint32_t *numbers = (uint32_t *)(buf + sizeof(journal_header));
+  memcpy(numbers, list, count * sizeof(uint32_t));
+  uint64_t sum = journal_sum(0xcbf29ce484222325ULL, numbers, (uint64_t)head * bs - sizeof(journal_header));
+  uint64_t at = (uint64_t)((*s).sb->journal_start + head) * bs;      // where the next copy goes
+  for (uint32_t i = 0; i < count; ) {
+    if (list[i] & JOURNAL_ZERO) {
+      i++;
+      continue;
+    }
+    uint32_t j = i + 1;
+    while (j < count && list[j] == list[j-1] + 1) {
+      j++;                                            // adjacent blocks are adjacent in the log too
+    }
+    uint64_t len = (uint64_t)(j - i) * bs;
+    sum = journal_sum(sum, block_at(s, list[i]), len);
+    if (write_at(s, block_at(s, list[i]), len, at) == -1) {
+      free(buf);
+      return -1;
     }
+    STAT(bytes_journaled, len);
+    at += len;
+    i = j;
   }
+  h->magic = JOURNAL_MAGIC;
+  h->count = count;
+  h->checksum = sum;
+  int status = write_at(s, buf, (uint64_t)head * bs, (uint64_t)(*s).sb->journal_start * bs);
+  STAT(bytes_journaled, (uint64_t)head * bs);
+  free(buf);
+  for (uint32_t i = 0; i < count; i++) {
+    list[i] &= ~JOURNAL_ZERO;
+  }
+  return status;
+}
 
-  printf("this is the name: %s \n", (*s).inodes[num].name);
-  printf("this is the parent of source file: %s \n", s->inodes[parent].name);
+// marking the journal empty, once every logged block is home
+int journal_clear (filesystem * s) {
+  journal_header h = {0};
+  return write_at(s, &h, sizeof(h), (uint64_t)(*s).sb->journal_start * (*s).sb->block_size);
+}
 
-  int parent2;                                     // finding inode of parent2 in which the file is to be moved
-  for (int l = 0; l < TOTAL_INODES; l++) {
-    if (exists(path2[i-2], s) == -1) {             
-      printf("The directory %s at the destination path does not exist.\n", path2[i-2]);    // in case of invalid path in the destination
-      return;
-    } else if (strcmp((*s).inodes[l].name,path2[i-2]) == 0) {      // finding the new parent of the file to be moved
-      parent2 = l;
-      printf("found: %s \n", s->inodes[parent2].name);
-      break;
+// committing every change since the last sync and writing it back to the image file
+// blocks the committed disk does not point at go in place first, so a crash can only leave them unreachable, the rest
+// is logged and flushed together with them, which makes the transaction durable, and is then written home
+// a transaction too large for the journal is not written at all, the image stays as of the last commit
+// a sync that fails keeps every block dirty, so the next one writes the whole transaction again
+int sync_disk (filesystem * s) {
+  mark_dirty(s, (*s).sb, sizeof(superblock));        // the free counts change with nearly every command
+  qsort((*s).dirty_list, (*s).dirty_count, sizeof(uint32_t), compare_blocks);
+  uint32_t *logged = malloc(((*s).dirty_count + 1) * sizeof(uint32_t));
+  if (logged == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  uint32_t in_place = 0, count = 0;
+  for (uint32_t i = 0; i < (*s).dirty_count; i++) {
+    uint32_t b = (*s).dirty_list[i];
+    if ((*s).fresh[b / 64] & ((uint64_t)1 << (b % 64))) {
+      (*s).dirty_list[in_place++] = b;               // both halves stay sorted
+    } else {
+      logged[count++] = b;
     }
   }
-
-  // converting the inode number to char 
-  char inode_num[20];
-  sprintf(inode_num, "%d", num);
-  inode_num[strlen(inode_num)] = '\0';
-
-  for (int b = 0; b < TOTAL_BLOCKPTRS; b++) {
-    int d_index = (*s).inodes[parent].blockptrs[b];              // finding the datablock index which contains the inode number of the current inode
-    if (strcmp(d_block[d_index]->index , inode_num) == 0) {
-      int b_index = block_index((*s).inodes[parent2]);           // finding the blockpointer index of the new parent which would point towards the datablock index
-      (*s).inodes[parent2].blockptrs[b_index] = (*s).inodes[parent].blockptrs[b];    // the new parent is now pointing towards the datablock index with inode number of current inode
-      (*s).inodes[parent].blockptrs[b] = -1;          // the blockpointer of the parent is no longer pointing towards the datablock index with the current inode number
+  int64_t writes = write_home(s, (*s).dirty_list, in_place);
+  int journaled = writes == -1 ? -1 : count == 0 ? 1 : journal_write(s, logged, count);
+  int fits = journaled != 1 || count == 0;
+  if (!fits) {
+    printf("The %u changed blocks do not fit in the journal of %u blocks, nothing since the last commit is written.\n",
+           count, (*s).sb->journal_blocks);                 // writing them in place could leave a torn mix behind a crash
+  } else if (journaled == 0) {
+    journaled = fdatasync((*s).fd) == -1 ? -1 : 0;   // the commit point
+  }
+  int64_t home = journaled == -1 || !fits ? -1 : write_home(s, logged, count);
+  int status = home == -1 || fdatasync((*s).fd) == -1 || (journaled == 0 && journal_clear(s) == -1) ? -1 : 0;
+  if (status == -1) {
+    if (fits) {
+      perror("Unable to write data to the file.\n");
     }
+    memcpy((*s).dirty_list + in_place, logged, count * sizeof(uint32_t));     // the list as it was, every block still dirty
+    free(logged);
+    return -1;
+  }
+  TRACE(TRACE_INFO, "synced %u blocks in %lld writes, %u of them logged \n", (*s).dirty_count, (long long)(writes + home),
+        journaled == 0 ? count : 0);
+  STAT(commits, 1);
+  for (uint32_t i = 0; i < (*s).dirty_count; i++) {
+    uint32_t b = i < in_place ? (*s).dirty_list[i] : logged[i - in_place];
+    (*s).dirty[b / 64] &= ~((uint64_t)1 << (b % 64));
   }
+  free(logged);
+  (*s).dirty_count = 0;
+  __atomic_store_n(&(*s).logged, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&(*s).since_commit, 0, __ATOMIC_RELAXED);
+  memset((*s).fresh, 0, ((*s).sb->total_blocks + 63) / 64 * sizeof(uint64_t));     // the disk now points at every used block
+  memset((*s).freed, 0, ((*s).sb->total_blocks + 63) / 64 * sizeof(uint64_t));
+  if (cache_full(s)) {
+    cache_evict(s);                                  // everything resident is now the same as the image file
+  }
+  return 0;
 }
 
-// list file info
-void listfile (superblock * s) {
-  for (int i = 0; i < TOTAL_INODES; i++){
-    if (s->inodes[i].used == 1){                 // selecting the inodes which are in use
-      if(s->inodes[i].dir == 1){                 // checking if it is a file or a directory
-        printf ("Directory: %s Directory size: %d \n", s->inodes[i].name, s->inodes[i].size);     // printing name and size of the directory
-      } else if (s->inodes[i].dir == 0) {
-        printf ("File name: %s File size: %d \n", s->inodes[i].name, s->inodes[i].size);    // printing name and size of the file
+// writing the transaction left in the journal of the image open at fd back home, before the image is mapped
+// returns the number of blocks replayed, 0 if there was no complete transaction, or -1 if the image could not be written
+int64_t journal_replay (int fd, superblock * sb) {
+  uint32_t bs = sb->block_size;
+  uint64_t start = (uint64_t)sb->journal_start * bs;
+  journal_header h;
+  if (pread(fd, &h, sizeof(h), start) != sizeof(h) || h.magic != JOURNAL_MAGIC ||
+      journal_head_blocks(bs, h.count) > sb->journal_blocks) {
+    return 0;
+  }
+  uint32_t head = journal_head_blocks(bs, h.count);
+  char *buf = malloc((uint64_t)(head + 1) * bs);     // the header and block numbers, then room for one copy
+  if (buf == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  uint32_t *numbers = (uint32_t *)(buf + sizeof(journal_header));
+  char *copy = buf + (uint64_t)head * bs;
+  if (pread(fd, buf, (uint64_t)head * bs, start) != (ssize_t)((uint64_t)head * bs)) {
+    free(buf);
+    return 0;
+  }
+  uint64_t sum = journal_sum(0xcbf29ce484222325ULL, numbers, (uint64_t)head * bs - sizeof(journal_header));
+  uint32_t copies = 0;
+  for (int pass = 0; pass < 2; pass++) {              // checking the whole log before writing any of it home
+    copies = 0;
+    for (uint32_t i = 0; i < h.count; i++) {
+      uint32_t b = numbers[i] & ~JOURNAL_ZERO;
+      if (b >= sb->total_blocks || head + copies + !(numbers[i] & JOURNAL_ZERO) > sb->journal_blocks) {
+        free(buf);
+        return 0;
+      }
+      if (numbers[i] & JOURNAL_ZERO) {
+        memset(copy, 0, bs);
+      } else if (pread(fd, copy, bs, start + (uint64_t)(head + copies++) * bs) != bs) {
+        free(buf);
+        return 0;
       }
+      if (pass == 0) {
+        sum = journal_sum(sum, copy, numbers[i] & JOURNAL_ZERO ? 0 : bs);
+      } else if (pwrite(fd, copy, bs, (uint64_t)b * bs) != bs) {
+        free(buf);
+        return -1;
+      }
+    }
+    if (pass == 0 && sum != h.checksum) {
+      free(buf);
+      return 0;                                       // the crash came before the commit was complete
     }
   }
-}
-
-// create directory
-void createdirectory (char * directory, superblock * s, datablock * d_block[]) {
-  //seperate condition for creation of root directory as we cannot parse using '/' because then root directory is '/'
-  if (strcmp(directory, "/") == 0){
-    (*s).inodes[0].used = 1;
-    (*s).inodes[0].dir = 1;
-    strcpy((*s).inodes[0].name, directory);
-    (*s).inodes[0].rsvd = 0;
-    (*s).inodes[0].size = 0;
-    return;
+  free(buf);
+  journal_header empty = {0};
+  if (fdatasync(fd) == -1 || pwrite(fd, &empty, sizeof(empty), start) != sizeof(empty) || fdatasync(fd) == -1) {
+    return -1;
   }
+  return h.count;
+}
 
-  char *path[TOTAL_BLOCKPTRS];        
-  char *single = strtok(directory, "/");
-  int i = 0;
+// transactions
+// every command runs inside the transaction of the next sync, which takes in a whole number of commands
 
-  while (single != NULL) {
-    path[i++] = single;
-    single = strtok(NULL, "/");
-  }
+// starting a command, a commit waits until it is done
+void txn_begin (filesystem * s) {
+  pthread_rwlock_rdlock(&(*s).txn_lock);
+}
 
-  if(strlen(path[i-1]) > FILENAME_MAXLEN) {                       // path[i-1] is the name of the directory to be created
-    printf("Name of the file cannot exceed 8 characters.\n");     // exiting if length of the name exceeds 8 characters
-    exit(1);
+// ending a command, committing once the group is complete, the journal is half full or the cache is over its capacity
+// returns -1 if the commit it ran failed, so the command's changes are not on the image yet
+int txn_end (filesystem * s) {
+  uint32_t n = __atomic_add_fetch(&(*s).since_commit, 1, __ATOMIC_RELAXED);     // counted before a commit can reset it
+  pthread_rwlock_unlock(&(*s).txn_lock);
+  uint32_t room = journal_room(s);
+  if (((*s).group_commit == 0 || n < (*s).group_commit) && __atomic_load_n(&(*s).logged, __ATOMIC_RELAXED) < room && !cache_full(s)) {
+    return 0;
   }
-
-  if(exists(path[i-1],s) != -1) {
-    printf("The directory already exists.\n");
-    exit(1);                                       // exiting if the file already exists in the inode table
+  pthread_rwlock_wrlock(&(*s).txn_lock);
+  int status = 0;
+  if (((*s).group_commit != 0 && __atomic_load_n(&(*s).since_commit, __ATOMIC_RELAXED) >= (*s).group_commit) ||
+      __atomic_load_n(&(*s).logged, __ATOMIC_RELAXED) >= room || cache_full(s)) {
+    status = sync_disk(s);                            // another thread may have committed first
   }
+  pthread_rwlock_unlock(&(*s).txn_lock);
+  return status;
+}
 
-  int previous = -1;      // variable to store the previous element of the path
+// locking
+// sync, format and mount only run while no command is running, everything else may run on many threads
 
-  for (int j = 0; j < i; j++) {
-    printf("Element in create directory: %d: %s\n", j, path[j]);
-    printf("Parent value in create directory: %d", exists(path[j],s));
-    printf("\n");
-    int parent = -1;                 // variable to check if the current element is a parent directory
-    parent = exists(path[j],s);      // using helper function to check
-    if ((*s).inodes[0].blockptrs[0] ==  -1) {     // if the root is not pointing towards anything then it should point towards the current inode
-      previous = 0;                               // parent of the current inode is root
-    }
+// taking the lock of directory k
+void lock_inode (filesystem * s, int k) {
+  pthread_mutex_lock(&(*s).inode_locks[k % INODE_LOCKS]);
+}
 
-    for (int k = 0; k < TOTAL_INODES; k++){
-      if ((*s).inodes[k].used == 0) {       // running a loop over all 16 inodes to find the next empty inode
+void unlock_inode (filesystem * s, int k) {
+  pthread_mutex_unlock(&(*s).inode_locks[k % INODE_LOCKS]);
+}
 
-        if (previous != -1 && parent == -1){     // if the previous directory in the path is the parent directory of the current directory and the current directory does not already exist
-          if (path[j] != path[i-1]) {
-            printf("The directory %s at the given path does not exist.\n", path[j]);    // error checking for wrong path
-            exit(1);
-          }
-          int d_index = data_index(s);          // finding the free index in the datablock
-          printf ("this is d_index in create directory: %d \n", d_index);
-          int b_index = block_index((*s).inodes[previous]);                  // finding free index of the blockpointer of the inode
-          printf ("this is b_index in create directory: %d \n", b_index);
-          if (d_index != -1 && b_index != -2) {        // if we have space both in the data block and the block pointer
-            char inode_num[20];                                          // converting inode num to char to store in the datablock
-            sprintf(inode_num, "%d", k);
-            inode_num[strlen(inode_num)] = '\0';                         // null-terminating
-            printf("this is converted to char: %s \n", inode_num);
-            strcpy(d_block[d_index]->index , inode_num);                 // storing the inode num to datablock
-            printf("printing the content of data block: %s \n", d_block[d_index]->index);
-            (*s).freeblocklist[d_index + 1] = '1';                 // updating the freeblock index because this index of the datablock is not occupied
-            (*s).inodes[previous].blockptrs[b_index] = d_index;    // blockpointer of the parent directory is pointing towards the datablock in which inode of the current directory is stored
-            printf("%d",(*s).inodes[previous].blockptrs[b_index]);
-            printf(" is the value stored in the blockpointer %d of %d inode in create directory \n", b_index, previous);
-          } else if (d_index == -1){                           // if there is no space in data block
-            printf ("No Space left in the data block \n");
-            exit(1);
-          } else if (b_index == -2){                           // when all 8 block pointers of the parent directory are pointing towards an index of data block
-            printf ("You cannot create more than 8 sub directories \n");
-            exit(1);
-          }
-        }
+// taking the locks of directories a and b in stripe order, so two threads locking the same pair cannot deadlock
+void lock_pair (filesystem * s, int a, int b) {
+  if (a % INODE_LOCKS > b % INODE_LOCKS) {
+    int t = a;
+    a = b;
+    b = t;
+  }
+  lock_inode(s, a);
+  lock_inode(s, b);                            // the locks are recursive, so a and b may share a stripe
+}
 
-        // if the current directory is new then changing attributes of inode
-        if (parent == -1) {      
-          (*s).inodes[k].used = 1;
-          (*s).inodes[k].dir = 1;
-          (*s).inodes[k].size = 0;
-          strcpy((*s).inodes[k].name, path[j]);
-          (*s).inodes[k].rsvd = 0;
-          break;
-        }
-      }
-    }
+void unlock_pair (filesystem * s, int a, int b) {
+  unlock_inode(s, a);
+  unlock_inode(s, b);
+}
 
-    previous = parent;      // making current node the parent for next iteration
-    parent = -1;
+// setting up the locks of a freshly mapped image
+void locks_init (filesystem * s) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  for (int i = 0; i < INODE_LOCKS; i++) {
+    pthread_mutex_init(&(*s).inode_locks[i], &attr);
+  }
+  pthread_mutex_init(&(*s).dedup_lock, &attr);            // an eviction can free a block while the table is held
+  pthread_mutexattr_destroy(&attr);
+  for (int i = 0; i < INDEX_LOCKS; i++) {
+    pthread_mutex_init(&(*s).index_locks[i], NULL);
   }
+  pthread_mutex_init(&(*s).dirty_lock, NULL);
+  pthread_mutex_init(&(*s).rename_lock, NULL);
+  pthread_rwlockattr_t rw;
+  pthread_rwlockattr_init(&rw);
+  pthread_rwlockattr_setkind_np(&rw, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);    // a commit is not starved by commands
+  pthread_rwlock_init(&(*s).txn_lock, &rw);
+  pthread_rwlock_init(&(*s).tree_lock, &rw);           // neither is ever taken twice by one thread
+  pthread_rwlockattr_destroy(&rw);
 }
 
-// remove a directory
-void removedirectory (char * directory, superblock * s, datablock * d_block[]) {
-  char *path[8];                              
-  char *single = strtok(directory, "/");
-  int i = 0;
+// releasing the locks
+void locks_destroy (filesystem * s) {
+  for (int i = 0; i < INODE_LOCKS; i++) {
+    pthread_mutex_destroy(&(*s).inode_locks[i]);
+  }
+  for (int i = 0; i < INDEX_LOCKS; i++) {
+    pthread_mutex_destroy(&(*s).index_locks[i]);
+  }
+  pthread_mutex_destroy(&(*s).dirty_lock);
+  pthread_mutex_destroy(&(*s).rename_lock);
+  pthread_mutex_destroy(&(*s).dedup_lock);
+  pthread_rwlock_destroy(&(*s).txn_lock);
+  pthread_rwlock_destroy(&(*s).tree_lock);
+  for (uint32_t i = 0; i < (*s).nshards; i++) {
+    pthread_mutex_destroy(&(*s).shards[i].lock);
+  }
+  free((*s).shards);
+  (*s).shards = NULL;
+}
 
-  while (single != NULL) {
-    path[i++] = single;
-    single = strtok(NULL, "/");
+// hashing a name of at most FILENAME_MAXLEN characters, seed mixes in anything else that belongs to the key
+unsigned int name_hash (const char * name, unsigned int seed) {
+  unsigned int h = 2166136261u ^ seed;
+  for (int i = 0; i < FILENAME_MAXLEN && name[i] != '\0'; i++) {
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
   }
+  return h;
+}
 
-  char * name = path[i-1];
-  printf("this is the directory name: %s \n", name);
+// hashing the parent inode together with the name
+unsigned int index_hash (int parent, const char * name, filesystem * s) {
+  return name_hash(name, (unsigned int)parent) & (*s).index.mask;
+}
 
-  if (exists(name, s) == -1){
-    printf("The directory does not exist.\n");        // error checking in case the directory does not exist
+// sizing the path index for the inode table and emptying it
+void index_reset (filesystem * s) {
+  unsigned int buckets = 16;
+  while (buckets < (*s).sb->total_inodes) {
+    buckets *= 2;                              // about one inode per bucket when the table is full
+  }
+  free((*s).index.head);
+  free((*s).index.next);
+  free((*s).index.loaded);
+  free((*s).index.generation);
+  (*s).index.head = malloc(buckets * sizeof(int));
+  (*s).index.next = malloc((*s).sb->total_inodes * sizeof(int));
+  (*s).index.loaded = calloc((*s).sb->total_inodes, 1);
+  (*s).index.generation = calloc((*s).sb->total_inodes, sizeof(uint32_t));
+  if ((*s).index.head == NULL || (*s).index.next == NULL || (*s).index.loaded == NULL || (*s).index.generation == NULL) {
+    perror("malloc");
     exit(1);
   }
+  (*s).index.mask = buckets - 1;
+  memset((*s).index.head, 0xff, buckets * sizeof(int));                  // every bucket starts out as -1
+  memset((*s).index.next, 0xff, (*s).sb->total_inodes * sizeof(int));
+}
 
-  int d_inode;
-  for (int i = 0; i < TOTAL_INODES; i++){
-    if (strcmp((*s).inodes[i].name, name) == 0){
-      d_inode = i;                                      // storing the inode number of the directory to be deleted
+// linking inode k under its parent directory, the name and parent are taken from the inode
+void index_insert (int k, filesystem * s) {
+  unsigned int b = index_hash((*s).inodes[k].parent, (*s).inodes[k].name, s);
+  pthread_mutex_lock(&(*s).index_locks[b % INDEX_LOCKS]);
+  (*s).index.next[k] = (*s).index.head[b];
+  (*s).index.head[b] = k;
+  pthread_mutex_unlock(&(*s).index_locks[b % INDEX_LOCKS]);
+}
+
+// the directory routines the index falls back on when an entry is not cached yet
+int64_t dir_find (filesystem * s, int d, const char * name);
+dirent * dir_slot (filesystem * s, int d, int64_t i);
+dirent * dir_next (filesystem * s, int d, int64_t * pos);
+
+// probing the index only, returns -1 if the entry is not cached
+int index_probe (int parent, const char * name, filesystem * s) {
+  unsigned int b = index_hash(parent, name, s);
+  int found = -1;
+  pthread_mutex_lock(&(*s).index_locks[b % INDEX_LOCKS]);
+  for (int c = (*s).index.head[b]; c != -1; c = (*s).index.next[c]) {
+    if ((*s).inodes[c].parent == parent && strncmp((*s).inodes[c].name, name, FILENAME_MAXLEN) == 0) {
+      found = c;
       break;
     }
   }
-  printf("this is the directory inode: %d \n", d_inode);  
+  pthread_mutex_unlock(&(*s).index_locks[b % INDEX_LOCKS]);
+  return found;
+}
 
-  int escape = 0;
-  int data_index;
-  for (int i = 0; i < TOTAL_INODES; i++){
-    for (int j = 0; j < TOTAL_BLOCKPTRS; j++){
-      data_index = (*s).inodes[i].blockptrs[j];             // finding the index of the data block of each of the block pointers of each inode    
-      if (atoi(d_block[data_index]->index) == d_inode){
-        printf("this is the data index which contains the inode %d \n", data_index);
-        printf("name of parent inode: %s and its blockpointer: %d \n", (*s).inodes[i].name, j);
-        for (int l = 0; l < 1024; l++) {
-          d_block[data_index]->index[l] = '\0';     // copying '\0' to each element of the index array
-        }
-        (*s).freeblocklist[data_index + 1] = '0';   // this index is now available for some other data            
-        (*s).inodes[i].blockptrs[j] = -1;           // the blockpointer of the parent directory is no longer pointing to the data index which contained the inode of the directory to be deleted   
-	      escape = 1;
-        break;
-      }
+// finding the child with the given name in the directory parent, returns -1 if there is none
+// a miss in a hashed directory is answered by the directory itself, a linear directory is cached whole on first use
+int index_lookup (int parent, const char * name, filesystem * s) {
+  if (strlen(name) > FILENAME_MAXLEN) {
+    return -1;                                 // such a name can never have been stored
+  }
+  int c = index_probe(parent, name, s);
+  if (c != -1 || __atomic_load_n(&(*s).index.loaded[parent], __ATOMIC_ACQUIRE)) {
+    return c;
+  }
+  lock_inode(s, parent);                       // every insert under parent happens with its lock held
+  c = index_probe(parent, name, s);
+  if (c != -1 || (*s).index.loaded[parent]) {
+    unlock_inode(s, parent);                   // another thread got here first
+    return c;
+  }
+  if ((*s).sb->flags & FS_HASHED_DIRS) {
+    int64_t slot = dir_find(s, parent, name);
+    if (slot != -1) {
+      c = dir_slot(s, parent, slot)->inode;
+      index_insert(c, s);
     }
-    if(escape == 1){
-      break;
+    unlock_inode(s, parent);
+    return c;
+  }
+  int64_t pos = 0;
+  dirent *e;
+  while ((e = dir_next(s, parent, &pos)) != NULL) {
+    if (index_probe(parent, (*s).inodes[e->inode].name, s) == -1) {
+      index_insert(e->inode, s);             // entries created this session are already there
     }
-  } 
+  }
+  __atomic_store_n(&(*s).index.loaded[parent], 1, __ATOMIC_RELEASE);
+  unlock_inode(s, parent);
+  return index_probe(parent, name, s);
+}
 
-  if (escape == 0){      // escape would only be 0 if we did not find the parent
-    printf("The directory at the given path does not exist.\n");       // parent not found means that there is incorrect path given
-    exit(1);
+// unlinking inode k, must be called before its name or parent changes
+void index_remove (int k, filesystem * s) {
+  unsigned int b = index_hash((*s).inodes[k].parent, (*s).inodes[k].name, s);
+  pthread_mutex_lock(&(*s).index_locks[b % INDEX_LOCKS]);
+  int *link = &(*s).index.head[b];
+  while (*link != -1 && *link != k) {
+    link = &(*s).index.next[*link];
+  }
+  if (*link == k) {
+    *link = (*s).index.next[k];
   }
+  (*s).index.next[k] = -1;
+  pthread_mutex_unlock(&(*s).index_locks[b % INDEX_LOCKS]);
+}
 
-  int d_block_index;
-  for (int k = 0; k < TOTAL_BLOCKPTRS; k++){
-    if ((*s).inodes[d_inode].blockptrs[k] != -1){              // checking if the blockpointers of the directory to be deleted are pointing towards any data index
-      d_block_index = (*s).inodes[d_inode].blockptrs[k];       // storing that data index
-      for (int l = 0; l < 1024; l++) {
-        d_block[d_block_index]->index[l] = '\0';               // copying '\0' to each element of the index array
-      }
-      (*s).freeblocklist[d_block_index + 1] = '0';             // setting this index of freeblocklist to 0 as it is now available for some other data
-      (*s).inodes[d_inode].blockptrs[k] = -1;                  // the blockpointer of the directory to be deleted is not pointing towards anything now 
+// adding delta to the size and count to the number of inodes below every directory above inode k by following the parent pointers
+// both change atomically, so files in different subtrees can be sized at once without locking their ancestors
+// the caller holds the tree lock, so the chain cannot be relinked halfway up
+void propagate_locked (int k, int64_t delta, int count, filesystem * s) {
+  for (int p = __atomic_load_n(&(*s).inodes[k].parent, __ATOMIC_RELAXED); p != -1; p = __atomic_load_n(&(*s).inodes[p].parent, __ATOMIC_RELAXED)) {
+    int64_t size = __atomic_add_fetch(&(*s).inodes[p].size, delta, __ATOMIC_RELAXED);
+    if (count != 0) {
+      __atomic_add_fetch(&(*s).inodes[p].below, count, __ATOMIC_RELAXED);
     }
+    inode_dirty(s, p);
+    STAT(ancestors_walked, 1);
+    TRACE(TRACE_VERBOSE, "this is the size of %.8s: %lld \n", trace_name((*s).inodes[p].name), size);
   }
+}
 
-  // setting up the inode values of the directory to be deleted
-  (*s).inodes[d_inode].used = 0;
-  (*s).inodes[d_inode].rsvd = 0;
-  strcpy(s->inodes[d_inode].name, "");
-  (*s).inodes[d_inode].dir = 0;
-  (*s).inodes[d_inode].size = 0;
+// propagating a change in the size or count of inode k while subtrees may be moved or removed on other threads
+void propagate_size (int k, int64_t delta, int count, filesystem * s) {
+  pthread_rwlock_rdlock(&(*s).tree_lock);
+  propagate_locked(k, delta, count, s);
+  pthread_rwlock_unlock(&(*s).tree_lock);
 }
 
-// main
-int main (int argc, char* argv[]) {
-  void * disk = malloc(128*1024);               // allocating 128 KB for the disk on heap
-  superblock * s_block = (superblock*) disk;    // superblock is the first 1KB of the disk
-  datablock * d_block[127];                     // datablock is the rest 127 KB of the disk
-  for (int i = 0; i < 127; i++) { 
-    d_block[i] = (datablock*)((char *)(disk + 1024) + (i * 1024));   // assigning 1 KB blocks to each element of d_block on the disk
+// splitting an absolute path into its components in place, returns the number of components or -1 if there are none or too many
+int split_path (char * p, char * path[]) {
+  int i = 0;
+  while (*p != '\0') {
+    if (*p == '/') {                   // separating the directories or files with '/'
+      *p++ = '\0';
+      continue;
+    }
+    if (i == MAX_DEPTH) {
+      printf("The path cannot be deeper than %d.\n", MAX_DEPTH);
+      return -1;
+    }
+    path[i++] = p;                     // adding all directories or files in the path
+    while (*p != '\0' && *p != '/') {
+      p++;
+    }
   }
 
-  set_null (s_block, d_block);       // setting the initial values of super block and data blocks 
-
-  createdirectory("/", s_block, d_block);   // creating root directory before reading any command
-
-  // while not EOF
-  FILE * stream = fopen ("sampleinput.txt", "r");
+  if (i == 0) {
+    printf("Invalid path.\n");         // nothing but the root was given
+    return -1;
+  }
+  return i;
+}
 
-  // read command
-  char line[1024];
-  while (fgets(line, sizeof(line), stream) != NULL) {
-    char command[4];           // will contain the command
-    char argument1[100];       // will contain the first argument
-    char argument2[100];       // will contain the second argument
+// the generation of inode k, which changes whenever k is freed
+uint32_t inode_generation (filesystem * s, int k) {
+  return __atomic_load_n(&(*s).index.generation[k], __ATOMIC_ACQUIRE);
+}
 
-    // parse command
-    sscanf(line, "%s %s %s", command, argument1, argument2);
+// checking, once its directory is locked, that inode k is still the one a walk found
+// a number that was freed and handed out again since then has a different generation
+int inode_current (filesystem * s, int k, uint32_t generation) {
+  return __atomic_load_n(&(*s).inodes[k].used, __ATOMIC_ACQUIRE) == 1 && inode_generation(s, k) == generation;
+}
 
-    // call appropriate function
-    if (strcmp(command, "CR") == 0){
-      if (check_space(s_block) == -1){                // if there is no space to create a file 
-        printf("No Space to create a file.\n");       // printing the error message and exiting the program
-        exit(1);
-      } else {
-        createfile(argument1, argument2, s_block, d_block);
-      }
-    } else if (strcmp(command, "CP") == 0) {
-      if (check_space(s_block) == -1){
-        printf("No Space to copy a file.\n");         // if there is no space to copy a file
-        exit(1);
-      } else {
-        copyfile(argument1, argument2, s_block, d_block);
-      }
-    } else if(strcmp(command, "DL") == 0) {
-      removefile(argument1, s_block, d_block);
-    } else if (strcmp(command, "MV") == 0) {
-      movefile(argument1, argument2, s_block, d_block);
-    } else if (strcmp(command, "LL") == 0) {
-      listfile(s_block);
-    } else if (strcmp(command, "CD") == 0) {
-      if (check_space(s_block) == -1){
-        printf("No Space to create directory.\n");     // if there is no space to create a directory
-        exit(1);
-      } else {
-        createdirectory(argument1, s_block, d_block);
-      }
-    } else if (strcmp(command, "DD") == 0) {
-      removedirectory(argument1, s_block, d_block);
+// walking the first count components of path from the root, returns the inode of the last one or -1
+// on failure *failed is set to the component that could not be found
+// unless generation is NULL it is set to the generation of the inode found, to be checked with inode_current
+int walk_path (char * path[], int count, filesystem * s, int * failed, uint32_t * generation) {
+  int current = 0;                                       // starting from the root directory
+  int parent = -1;
+  for (int j = 0; j < count; j++) {
+    if ((*s).inodes[current].dir != 1) {                 // only directories can have children
+      *failed = j - 1;
+      return -1;
+    }
+    parent = current;
+    current = index_lookup(parent, path[j], s);
+    if (current == -1) {
+      *failed = j;
+      return -1;
     }
   }
+  if (generation != NULL) {
+    *generation = inode_generation(s, current);
+    if (parent != -1 && index_lookup(parent, path[count-1], s) != current) {
+      *failed = count - 1;                               // freed and reused since the lookup, the path no longer leads to it
+      return -1;
+    }
+  }
+  return current;
+}
 
-  const char *filename = "my_fs.txt";     // filename 
-  int filesize = 128 * 1024;              // 128 KB
-  FILE *file = fopen(filename, "wb");     
+// the free counts change atomically on many threads, so they are read atomically as well
+uint32_t free_inode_count (filesystem * s) {
+  return __atomic_load_n(&(*s).sb->free_inodes, __ATOMIC_ACQUIRE);
+}
 
-  char *buffer = (char *)malloc(filesize);             // creating buffer on heap
-  if (buffer == NULL) {
-    perror("Failed to allocate memory for buffer");    // to handle allocation failure
-    fclose(file);
-    return 1;
+uint32_t free_block_count (filesystem * s) {
+  return __atomic_load_n(&(*s).sb->free_blocks, __ATOMIC_ACQUIRE);
+}
+
+// checking if all inodes are in use or not
+int check_space (filesystem * s){
+  return free_inode_count(s) > 0 ? 1 : -1;      // 1 if there is space left, -1 otherwise
+}
+
+// claiming an unused inode, returns its number or -1 if all inodes are in use
+int alloc_inode (filesystem * s) {
+  uint32_t total = (*s).sb->total_inodes;
+  for (uint32_t n = 0; n < total; n++) {
+    uint32_t k = (__atomic_load_n(&(*s).inode_hint, __ATOMIC_RELAXED) + n) % total;  // starting after the inode handed out last
+    int expected = 0;
+    if (__atomic_load_n(&(*s).inodes[k].used, __ATOMIC_RELAXED) == 0 &&
+        __atomic_compare_exchange_n(&(*s).inodes[k].used, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      inode_dirty(s, k);                         // claimed, no other thread can take it now
+      __atomic_sub_fetch(&(*s).sb->free_inodes, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&(*s).inode_hint, (k + 1) % total, __ATOMIC_RELAXED);
+      STAT(inodes_scanned, n + 1);
+      return k;
+    }
+  }
+  STAT(inodes_scanned, total);
+  return -1;
+}
+
+// returning inode k to the inode table, it must already be unlinked from the path index
+void free_inode (int k, filesystem * s) {
+  (*s).inodes[k].entries = 0;
+  (*s).inodes[k].below = 0;
+  __atomic_store_n(&(*s).index.loaded[k], 0, __ATOMIC_RELAXED);     // both are read by lookups that hold no lock
+  __atomic_store_n(&(*s).inodes[k].parent, -1, __ATOMIC_RELAXED);
+  memset((*s).inodes[k].name, 0, FILENAME_MAXLEN);
+  (*s).inodes[k].dir = 0;
+  (*s).inodes[k].size = 0;
+  memset((*s).inodes[k].data, 0, INLINE_MAX);
+  inode_dirty(s, k);
+  __atomic_add_fetch(&(*s).index.generation[k], 1, __ATOMIC_RELEASE);  // a walk that found k before this fails its check
+  __atomic_add_fetch(&(*s).sb->free_inodes, 1, __ATOMIC_RELAXED);   // counted before it can be claimed, so the count never wraps
+  __atomic_store_n(&(*s).inodes[k].used, 0, __ATOMIC_RELEASE);     // cleared last, so whoever takes it next finds it clean
+}
+
+// marking block b as in use or free in the bitmap
+void set_bit (filesystem * s, uint32_t b, int used) {
+  if (used) {
+    (*s).freeblocklist[b / 64] |= (uint64_t)1 << (b % 64);
+  } else {
+    (*s).freeblocklist[b / 64] &= ~((uint64_t)1 << (b % 64));
+  }
+  mark_dirty(s, &(*s).freeblocklist[b / 64], sizeof(uint64_t));
+}
+
+// blocks in the journal of a disk of the given number of blocks, metadata_blocks of them before the journal
+// the group commit fills a thirty second of the disk, the reserve on top keeps the last command journaled too
+uint64_t journal_size (uint64_t blocks, uint32_t block_size, uint64_t metadata_blocks) {
+  uint64_t j = blocks / 32;
+  j = j < JOURNAL_MIN ? JOURNAL_MIN : j > JOURNAL_MAX ? JOURNAL_MAX : j;
+  return j + journal_reserve(blocks, block_size, metadata_blocks);
+}
+
+// blocks in the dedup table of a disk of the given size, a power of two number of slots, one for every DEDUP_RATIO
+// blocks and at least a block of them, none without FS_DEDUP
+uint32_t dedup_size (uint64_t blocks, uint32_t block_size, uint32_t flags) {
+  if (!(flags & FS_DEDUP)) {
+    return 0;
+  }
+  uint64_t slots = block_size / sizeof(dedup_entry);
+  while (slots * DEDUP_RATIO < blocks) {
+    slots *= 2;
+  }
+  return slots * sizeof(dedup_entry) / block_size;
+}
+
+// checking that the geometry can hold the superblock, bitmap, inode table and at least one data block
+int check_geometry (uint32_t inodes, uint32_t block_size, uint64_t disk_size, uint32_t flags) {
+  if (block_size < 256 || block_size > 65536 || (block_size & (block_size - 1)) != 0) {
+    printf("Block size must be a power of two between 256 and 65536.\n");
+    return -1;
+  }
+  uint64_t blocks = disk_size / block_size;
+  if (inodes < 1 || blocks > INT32_MAX) {
+    printf("Invalid inode count or disk size.\n");
+    return -1;
+  }
+  uint64_t bitmap_blocks = ((blocks + 63) / 64 * sizeof(uint64_t) + block_size - 1) / block_size;
+  uint64_t refcount_blocks = (blocks * sizeof(uint32_t) + block_size - 1) / block_size;
+  uint64_t inode_blocks = ((uint64_t)inodes * sizeof(inode) + block_size - 1) / block_size;
+  uint64_t metadata_blocks = 1 + bitmap_blocks + refcount_blocks + dedup_size(blocks, block_size, flags) + inode_blocks;
+  if (metadata_blocks + journal_size(blocks, block_size, metadata_blocks) >= blocks) {
+    printf("The disk is too small for %u inodes.\n", inodes);
+    return -1;
+  }
+  return 0;
+}
+
+// splitting the bitmap into allocator shards, as many as there are words for up to MAX_SHARDS
+void shards_reset (filesystem * s) {
+  uint32_t words = ((*s).sb->total_blocks + 63) / 64;
+  uint32_t n = words / SHARD_MIN_WORDS;
+  n = n < 1 ? 1 : n > MAX_SHARDS ? MAX_SHARDS : n;
+  (*s).shard_words = (words + n - 1) / n;
+  (*s).nshards = (words + (*s).shard_words - 1) / (*s).shard_words;
+  (*s).shards = malloc((*s).nshards * sizeof(shard));
+  if ((*s).shards == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (uint32_t i = 0; i < (*s).nshards; i++) {
+    shard *sh = &(*s).shards[i];
+    pthread_mutex_init(&sh->lock, NULL);
+    sh->first = i * (*s).shard_words * 64;
+    sh->end = (i + 1 == (*s).nshards ? words : (i + 1) * (*s).shard_words) * 64;
+    sh->hint = sh->first;
+    sh->free = 0;
+    for (uint32_t w = sh->first / 64; w < sh->end / 64; w++) {
+      sh->free += 64 - __builtin_popcountll((*s).freeblocklist[w]);   // the bitmap is small next to the disk
+    }
+  }
+}
+
+// setting up the dirty tracking for a freshly mapped image
+void dirty_reset (filesystem * s) {
+  free((*s).dirty);
+  free((*s).dirty_list);
+  free((*s).fresh);
+  free((*s).freed);
+  uint32_t words = ((*s).sb->total_blocks + 63) / 64;
+  (*s).dirty = calloc(words, sizeof(uint64_t));
+  (*s).fresh = calloc(words, sizeof(uint64_t));
+  (*s).freed = calloc(words, sizeof(uint64_t));
+  if ((*s).dirty == NULL || (*s).fresh == NULL || (*s).freed == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  (*s).dirty_list = NULL;
+  (*s).dirty_count = 0;
+  (*s).dirty_cap = 0;
+  (*s).logged = 0;
+  (*s).since_commit = 0;
+}
+
+// pointing at the dedup table of the disk and marking the blocks it holds
+// the hashes of the fill pattern are worked out again as they are needed
+void dedup_reset (filesystem * s) {
+  free((*s).pinned);
+  (*s).pinned = NULL;
+  (*s).dedup = NULL;
+  (*s).dedup_used = 0;
+  memset((*s).pattern_hash, 0, sizeof((*s).pattern_hash));
+  if ((*s).sb->dedup_blocks == 0) {
+    return;
+  }
+  (*s).dedup = (dedup_entry *)block_at(s, (*s).sb->dedup_start);
+  (*s).dedup_mask = (uint64_t)(*s).sb->dedup_blocks * (*s).sb->block_size / sizeof(dedup_entry) - 1;
+  (*s).pinned = calloc(((*s).sb->total_blocks + 63) / 64, sizeof(uint64_t));
+  if ((*s).pinned == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for (uint32_t i = 0; i <= (*s).dedup_mask; i++) {
+    uint32_t b = (*s).dedup[i].block;
+    if (b != 0 && b < (*s).sb->total_blocks) {
+      (*s).pinned[b / 64] |= (uint64_t)1 << (b % 64);
+      (*s).dedup_used++;
+    }
+  }
+}
+
+// formatting the disk image with the given geometry, the image must be zero filled and the geometry checked
+void format (filesystem * s, uint32_t inodes, uint32_t block_size, uint64_t disk_size, uint32_t flags) {
+  uint64_t blocks = disk_size / block_size;
+  uint64_t bitmap_bytes = (blocks + 63) / 64 * sizeof(uint64_t);
+  uint64_t bitmap_blocks = (bitmap_bytes + block_size - 1) / block_size;
+  uint64_t refcount_blocks = (blocks * sizeof(uint32_t) + block_size - 1) / block_size;
+  uint64_t inode_blocks = ((uint64_t)inodes * sizeof(inode) + block_size - 1) / block_size;
+
+  superblock * sb = (superblock *)(*s).disk;
+  memset(sb, 0, block_size);
+  sb->magic = FS_MAGIC;
+  sb->version = FS_VERSION;
+  sb->block_size = block_size;
+  sb->total_blocks = blocks;
+  sb->total_inodes = inodes;
+  sb->bitmap_start = 1;                                  // the bitmap follows the superblock
+  sb->bitmap_blocks = bitmap_blocks;
+  sb->refcount_start = 1 + bitmap_blocks;                // then the reference counts
+  sb->refcount_blocks = refcount_blocks;
+  sb->dedup_start = sb->refcount_start + refcount_blocks;     // then the dedup table
+  sb->dedup_blocks = dedup_size(blocks, block_size, flags);
+  sb->inode_start = sb->dedup_start + sb->dedup_blocks;       // then the inode table
+  sb->inode_blocks = inode_blocks;
+  sb->journal_start = sb->inode_start + inode_blocks;    // then the journal
+  sb->journal_blocks = journal_size(blocks, block_size, sb->journal_start);     // everything before it is metadata
+  sb->data_start = sb->journal_start + sb->journal_blocks;     // and everything after it holds data
+  sb->free_blocks = blocks - sb->data_start;
+  sb->free_inodes = inodes;
+  sb->flags = flags;
+
+  (*s).sb = sb;
+  (*s).freeblocklist = (uint64_t *)block_at(s, sb->bitmap_start);
+  (*s).refcounts = (uint32_t *)block_at(s, sb->refcount_start);
+  (*s).inodes = (inode *)block_at(s, sb->inode_start);
+  memset((*s).freeblocklist, 0, (uint64_t)(sb->inode_start + inode_blocks - 1) * block_size);
+  STAT(bytes_zeroed, (uint64_t)(sb->inode_start + inode_blocks - 1) * block_size);
+  dirty_reset(s);
+  memset((*s).fresh, 0xff, (blocks + 63) / 64 * sizeof(uint64_t));     // nothing is committed yet, so the first sync goes in place
+  mark_dirty(s, (*s).disk, (uint64_t)sb->journal_start * block_size);  // all of the metadata goes out at the first sync
+
+  for (uint32_t i = 0; i < inodes; i++) {
+    (*s).inodes[i].used = 0;                      // to indicate that inode is not in use
+    (*s).inodes[i].parent = -1;                   // to indicate that inode is not linked under any directory
+    (*s).inodes[i].dir = 0;                       // initially considering that it is not a directory, would change to 1 in case of a directory
+    (*s).inodes[i].size = 0;                      // initializing size with 0
+    for (int j = 0; j < TOTAL_BLOCKPTRS; j++){       // looping over each blockpointer of each inode
+      (*s).inodes[i].blockptrs[j] = -1;              // to indicate that the blockpointer is not pointing towards any block of the disk
+    }
+    (*s).inodes[i].indirect = -1;
+    (*s).inodes[i].dindirect = -1;
+    (*s).inodes[i].entries = 0;
+    (*s).inodes[i].blocks = 0;
+    memset((*s).inodes[i].data, 0, INLINE_MAX);
+  }
+
+  for (uint32_t b = 0; b < sb->data_start; b++) {
+    set_bit(s, b, 1);                                     // the superblock, bitmap and inode table are never handed out
+  }
+  for (uint64_t b = blocks; b < bitmap_bytes * 8; b++) {
+    set_bit(s, b, 1);                                     // bits past the end of the disk can never be handed out either
+  }
+  (*s).inode_hint = 0;
+
+  index_reset(s);                          // nothing is linked in the path index yet
+  dedup_reset(s);
+  locks_init(s);
+  shards_reset(s);
+}
+
+// creating the image file at path, mapping it and formatting it with the given geometry, returns -1 on failure
+int create_image (filesystem * s, const char * path, uint32_t inodes, uint32_t block_size, uint64_t disk_size, uint32_t flags) {
+  if (check_geometry(inodes, block_size, disk_size, flags) == -1) {
+    return -1;
+  }
+  (*s).map_size = disk_size / block_size * block_size;
+  (*s).fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if ((*s).fd == -1 || ftruncate((*s).fd, (*s).map_size) == -1) {     // a sparse file, every block reads as zeroes
+    perror("Unable to create the disk image");
+    return -1;
+  }
+  (*s).disk = mmap(NULL, (*s).map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, (*s).fd, 0);
+  if ((*s).disk == MAP_FAILED) {
+    perror("Unable to map the disk image");
+    return -1;
+  }
+  format(s, inodes, block_size, disk_size, flags);
+  cache_reset(s);
+  return 0;
+}
+
+// mapping an existing image file after checking its superblock, returns -1 if it is not a usable disk
+// nothing but the superblock is read here, every other block is paged in when a command first touches it
+int mount_image (filesystem * s, const char * path) {
+  (*s).fd = open(path, O_RDWR);
+  if ((*s).fd == -1) {
+    perror("Unable to open the disk image");
+    return -1;
+  }
+  struct stat st;
+  superblock sb;
+  if (fstat((*s).fd, &st) == -1 || pread((*s).fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+    printf("%s is not a formatted disk.\n", path);
+    return -1;
+  }
+  uint64_t bitmap_blocks = ((uint64_t)sb.total_blocks + 63) / 64 * sizeof(uint64_t);
+  if (sb.magic != FS_MAGIC || sb.version != FS_VERSION) {
+    printf("%s is not a formatted disk of version %d.\n", path, FS_VERSION);
+    return -1;
+  }
+  if (sb.block_size < 256 || sb.block_size > 65536 || (sb.block_size & (sb.block_size - 1)) != 0 ||
+      (uint64_t)sb.total_blocks * sb.block_size > (uint64_t)st.st_size ||
+      sb.bitmap_start != 1 || (uint64_t)sb.bitmap_blocks * sb.block_size < bitmap_blocks ||
+      sb.refcount_start != sb.bitmap_start + sb.bitmap_blocks ||
+      (uint64_t)sb.refcount_blocks * sb.block_size < (uint64_t)sb.total_blocks * sizeof(uint32_t) ||
+      sb.dedup_start != sb.refcount_start + sb.refcount_blocks || sb.inode_start != sb.dedup_start + sb.dedup_blocks ||
+      (sb.dedup_blocks == 0) != !(sb.flags & FS_DEDUP) ||
+      (uint64_t)sb.inode_blocks * sb.block_size < (uint64_t)sb.total_inodes * sizeof(inode) ||
+      sb.journal_start != sb.inode_start + sb.inode_blocks || sb.journal_blocks < JOURNAL_MIN ||
+      sb.data_start != sb.journal_start + sb.journal_blocks || sb.data_start >= sb.total_blocks) {
+    printf("The superblock of %s is damaged.\n", path);
+    return -1;
+  }
+  int64_t replayed = journal_replay((*s).fd, &sb);   // finishing the last transaction if a crash interrupted it
+  if (replayed == -1 || pread((*s).fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+    perror("Unable to replay the journal");
+    return -1;
+  }
+  if (replayed > 0) {
+    printf("Replayed %lld blocks from the journal of %s.\n", (long long)replayed, path);
+  }
+
+  (*s).map_size = (uint64_t)sb.total_blocks * sb.block_size;
+  (*s).disk = mmap(NULL, (*s).map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, (*s).fd, 0);
+  if ((*s).disk == MAP_FAILED) {
+    perror("Unable to map the disk image");
+    return -1;
+  }
+  (*s).sb = (superblock *)(*s).disk;
+  (*s).freeblocklist = (uint64_t *)block_at(s, sb.bitmap_start);
+  (*s).refcounts = (uint32_t *)block_at(s, sb.refcount_start);
+  (*s).inodes = (inode *)block_at(s, sb.inode_start);
+  (*s).inode_hint = 0;
+  index_reset(s);                          // the index is filled from the directories as they are used
+  dirty_reset(s);
+  cache_reset(s);
+  dedup_reset(s);
+  locks_init(s);
+  shards_reset(s);
+  return 0;
+}
+
+// releasing the image without writing anything back
+void release_image (filesystem * s) {
+  munmap((*s).disk, (*s).map_size);
+  close((*s).fd);
+  free((*s).index.head);
+  free((*s).index.next);
+  free((*s).index.loaded);
+  free((*s).index.generation);
+  free((*s).dirty);
+  free((*s).dirty_list);
+  free((*s).fresh);
+  free((*s).freed);
+  free((*s).pinned);
+  (*s).pinned = NULL;
+  free((*s).cache);
+  (*s).cache = NULL;
+  locks_destroy(s);
+}
+
+// writing the changed blocks back to the image file and releasing it
+int unmount_image (filesystem * s) {
+  int status = sync_disk(s);
+  release_image(s);
+  return status;
+}
+
+// finding the first free bit of shard sh at or after bit start, wrapping around the shard once, returns -1 if it is full
+int64_t find_free (filesystem * s, shard * sh, uint32_t start) {
+  uint32_t first = sh->first / 64, words = (sh->end - sh->first) / 64;
+  uint32_t w = start / 64;
+  uint64_t free_bits = ~(*s).freeblocklist[w] & (~(uint64_t)0 << (start % 64));    // ignoring the bits below start in its word
+  for (uint32_t n = 0; n <= words; n++) {
+    if (free_bits != 0) {
+      STAT(blocks_scanned, (uint64_t)n * 64 + __builtin_ctzll(free_bits) + 1);
+      return (int64_t)w * 64 + __builtin_ctzll(free_bits);         // lowest clear bit of the word
+    }
+    w = w + 1 == first + words ? first : w + 1;
+    free_bits = ~(*s).freeblocklist[w];
+  }
+  STAT(blocks_scanned, (uint64_t)words * 64);
+  return -1;
+}
+
+// length of the run of free bits starting at bit b, counting no further than max or past bit end
+uint32_t free_run (filesystem * s, uint32_t b, uint32_t max, uint32_t end) {
+  uint32_t len = 0;
+  while (len < max && b < end) {
+    uint64_t used = (*s).freeblocklist[b / 64] >> (b % 64);       // the used bits from b up to the end of its word
+    uint32_t avail = used == 0 ? 64 - b % 64 : (uint32_t)__builtin_ctzll(used);
+    len += avail;
+    b += avail;
+    if (used != 0) {
+      break;                                                      // reached a block that is in use
+    }
+  }
+  return len < max ? len : max;
+}
+
+// allocating count contiguous blocks of shard sh with next fit, the caller holds its lock, returns the first block or -1
+int shard_alloc (filesystem * s, shard * sh, uint32_t count) {
+  if (sh->free < count) {
+    return -1;
+  }
+  uint32_t size = sh->end - sh->first;
+  uint32_t start = sh->hint;
+  uint64_t scanned = 0;
+  while (scanned < size) {
+    int64_t b = find_free(s, sh, start);
+    if (b == -1) {
+      return -1;                                     // in case all blocks of the shard are in use
+    }
+    scanned += ((uint64_t)b + size - start) % size;
+    uint32_t len = free_run(s, b, count, sh->end);
+    if (len == count) {
+      for (uint32_t i = b; i < b + count; i++) {
+        set_bit(s, i, 1);                            // marking the run as in use
+        if (!((*s).freed[i / 64] & ((uint64_t)1 << (i % 64)))) {
+          __atomic_fetch_or(&(*s).fresh[i / 64], (uint64_t)1 << (i % 64), __ATOMIC_RELAXED);    // free on the committed disk too
+        }
+      }
+      sh->hint = b + count < sh->end ? b + count : sh->first;
+      sh->free -= count;
+      return b;
+    }
+    scanned += len + 1;
+    start = b + len + 1 < sh->end ? b + len + 1 : sh->first;    // continuing after the block that cut the run short
+  }
+  return -1;
+}
+
+// allocating count contiguous blocks, from the thread's own shard first, returns the first block or -1
+// a run never crosses shards, so a run longer than a shard always fails and the caller asks for shorter ones
+int alloc_run (filesystem * s, uint32_t count) {
+  if (count > __atomic_load_n(&(*s).sb->free_blocks, __ATOMIC_RELAXED)) {
+    return -1;                                       // not enough free blocks left, however they are laid out
+  }
+  for (uint32_t n = 0; n < (*s).nshards; n++) {
+    shard *sh = &(*s).shards[(my_slot + n) % (*s).nshards];
+    pthread_mutex_lock(&sh->lock);
+    int b = shard_alloc(s, sh, count);
+    pthread_mutex_unlock(&sh->lock);
+    if (b != -1) {
+      __atomic_sub_fetch(&(*s).sb->free_blocks, count, __ATOMIC_RELAXED);
+      return b;
+    }
+  }
+  return -1;
+}
+
+// allocating a single block, returns it or -1 if there is no space
+int alloc_block (filesystem * s) {
+  return alloc_run(s, 1);
+}
+
+// sharing
+// a copied file shares the blocks of its source, with the count of each block raised by one, and an index block
+// that is shared shares everything below it, so copying a file of any size only touches its inode's pointers
+// a block is copied before a file changes it while it is shared, and released only when its last reference goes
+
+// references to block b beyond the first
+// a block only one file maps can only gain a reference through that file, while its directory is locked: CP holds
+// the source's directory, the dedup table only hands out blocks it already holds a reference to, and snapshots run
+// alone, so a writer holding the directory that sees a count of 0 can write the block in place
+uint32_t block_refs (filesystem * s, int b) {
+  return __atomic_load_n(&(*s).refcounts[b], __ATOMIC_ACQUIRE);
+}
+
+// adding a reference to block b
+void block_share (filesystem * s, int b) {
+  __atomic_add_fetch(&(*s).refcounts[b], 1, __ATOMIC_RELAXED);
+  mark_dirty(s, &(*s).refcounts[b], sizeof(uint32_t));
+}
+
+void dedup_evict (filesystem * s, int b);
+
+// dropping a reference to block b if it is shared, returns 1 if another file still holds it
+// a block left to the dedup table alone is freed, so it is no longer the caller's either way
+int block_unshare (filesystem * s, int b) {
+  uint32_t count = __atomic_load_n(&(*s).refcounts[b], __ATOMIC_RELAXED);
+  while (count > 0) {
+    if (__atomic_compare_exchange_n(&(*s).refcounts[b], &count, count - 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      mark_dirty(s, &(*s).refcounts[b], sizeof(uint32_t));
+      if (count == 1 && (*s).pinned != NULL && (__atomic_load_n(&(*s).pinned[b / 64], __ATOMIC_RELAXED) >> (b % 64)) & 1) {
+        dedup_evict(s, b);
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// zeroing block b and returning it to the free bitmap, so free blocks always read as zeroes
+// a shared block only loses one reference
+void free_block (filesystem * s, int b) {
+  if (block_unshare(s, b)) {
+    return;
+  }
+  memset(block_at(s, b), 0, (*s).sb->block_size);  // the block is still marked used, so no other thread can have it yet
+  STAT(bytes_zeroed, (*s).sb->block_size);
+  mark_dirty(s, block_at(s, b), (*s).sb->block_size);
+  if (my_batch != NULL) {
+    if (my_batch->count == my_batch->cap) {
+      my_batch->cap = my_batch->cap ? my_batch->cap * 2 : 1024;
+      my_batch->blocks = realloc(my_batch->blocks, my_batch->cap * sizeof(uint32_t));
+      if (my_batch->blocks == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    my_batch->blocks[my_batch->count++] = b;         // returned to the bitmap with the rest of the batch
+    return;
+  }
+  shard *sh = &(*s).shards[(uint32_t)b / 64 / (*s).shard_words];
+  pthread_mutex_lock(&sh->lock);
+  set_bit(s, b, 0);
+  if (!((*s).fresh[b / 64] & ((uint64_t)1 << (b % 64)))) {
+    (*s).freed[b / 64] |= (uint64_t)1 << (b % 64);  // the committed disk still points at it until the next sync
+  }
+  sh->free++;
+  pthread_mutex_unlock(&sh->lock);
+  __atomic_add_fetch(&(*s).sb->free_blocks, 1, __ATOMIC_RELAXED);
+}
+
+// returning the blocks collected in batch to the bitmap and the free count, and emptying it
+// the blocks of a tree come mostly in runs from the same shard, so a shard lock is taken once for each run
+void batch_release (filesystem * s, release_batch * batch) {
+  shard *held = NULL;
+  for (uint32_t i = 0; i < batch->count; i++) {
+    uint32_t b = batch->blocks[i];
+    shard *sh = &(*s).shards[b / 64 / (*s).shard_words];
+    if (sh != held) {
+      if (held != NULL) {
+        pthread_mutex_unlock(&held->lock);
+      }
+      pthread_mutex_lock(&sh->lock);
+      held = sh;
+    }
+    set_bit(s, b, 0);
+    if (!((*s).fresh[b / 64] & ((uint64_t)1 << (b % 64)))) {
+      (*s).freed[b / 64] |= (uint64_t)1 << (b % 64);
+    }
+    sh->free++;
+  }
+  if (held != NULL) {
+    pthread_mutex_unlock(&held->lock);
+  }
+  __atomic_add_fetch(&(*s).sb->free_blocks, batch->count, __ATOMIC_RELAXED);
+  batch->count = 0;
+}
+
+// file blocks
+// a file's first TOTAL_BLOCKPTRS blocks come from the direct pointers, the next block_size/4 from the
+// indirect block and the rest from the indirect blocks listed in the double indirect block
+// every pointer in an index block is -1 until it points to a block
+
+// number of block pointers that fit in one block
+int64_t ptrs_per_block (filesystem * s) {
+  return (*s).sb->block_size / sizeof(int);
+}
+
+// largest number of blocks a single file can have
+int64_t max_file_blocks (filesystem * s) {
+  int64_t p = ptrs_per_block(s);
+  return TOTAL_BLOCKPTRS + p + p * p;
+}
+
+// data blocks a file of size bytes holds, none when its content fits in the inode
+int64_t file_blocks (filesystem * s, int64_t size) {
+  return size <= INLINE_MAX ? 0 : (size + (*s).sb->block_size - 1) / (*s).sb->block_size;
+}
+
+// number of index blocks a file of nblocks blocks needs on top of its data blocks
+int64_t index_blocks (filesystem * s, int64_t nblocks) {
+  int64_t p = ptrs_per_block(s);
+  int64_t count = 0;
+  nblocks -= TOTAL_BLOCKPTRS;
+  if (nblocks > 0) {
+    count++;                                          // the indirect block
+    nblocks -= p;
+  }
+  if (nblocks > 0) {
+    count += 1 + (nblocks + p - 1) / p;               // the double indirect block and the indirect blocks under it
+  }
+  return count;
+}
+
+// giving the file holding *slot its own copy of the shared block there, an index block if index is set
+// returns -1 if there is no space for the copy
+int private_block (filesystem * s, int * slot, int index) {
+  int old = *slot;
+  int b = alloc_block(s);
+  if (b == -1) {
+    return -1;
+  }
+  memcpy(block_at(s, b), block_at(s, old), (*s).sb->block_size);
+  mark_dirty(s, block_at(s, b), (*s).sb->block_size);
+  if (index) {
+    int *ptrs = (int *)block_at(s, b);
+    for (int64_t i = 0; i < ptrs_per_block(s); i++) {
+      if (ptrs[i] != -1) {
+        block_share(s, ptrs[i]);                  // what was shared through the old block is now shared directly
+      }
+    }
+  }
+  if (!block_unshare(s, old)) {                   // the other file let go of it meanwhile, so the old block is ours alone
+    if (index) {
+      int *ptrs = (int *)block_at(s, b);
+      for (int64_t i = 0; i < ptrs_per_block(s); i++) {
+        if (ptrs[i] != -1) {
+          block_unshare(s, ptrs[i]);
+        }
+      }
+    }
+    free_block(s, b);
+    return 0;
+  }
+  *slot = b;
+  mark_dirty(s, slot, sizeof(int));
+  return 0;
+}
+
+// the pointers held by the index block in *slot, allocating the index block if create is set
+// with create set a shared index block is copied first, so the caller can change its pointers
+// returns NULL if there is no such block
+int * index_block (filesystem * s, int * slot, int create) {
+  if (*slot == -1) {
+    if (!create) {
+      return NULL;
+    }
+    int b = alloc_block(s);
+    if (b == -1) {
+      return NULL;
+    }
+    memset(block_at(s, b), 0xff, (*s).sb->block_size);      // every pointer starts out as -1
+    mark_dirty(s, block_at(s, b), (*s).sb->block_size);
+    *slot = b;
+    mark_dirty(s, slot, sizeof(int));
+  } else if (create && block_refs(s, *slot) > 0 && private_block(s, slot, 1) == -1) {
+    return NULL;
+  }
+  return (int *)block_at(s, *slot);
+}
+
+// finding the slot for bmap
+int * bmap_slot (filesystem * s, int k, int64_t fbn, int create) {
+  int64_t p = ptrs_per_block(s);
+  if (fbn < TOTAL_BLOCKPTRS) {
+    return &(*s).inodes[k].blockptrs[fbn];
+  }
+  fbn -= TOTAL_BLOCKPTRS;
+  if (fbn < p) {
+    int *ind = index_block(s, &(*s).inodes[k].indirect, create);
+    return ind == NULL ? NULL : &ind[fbn];
+  }
+  fbn -= p;
+  if (fbn < p * p) {
+    int *dind = index_block(s, &(*s).inodes[k].dindirect, create);
+    if (dind == NULL) {
+      return NULL;
+    }
+    int *ind = index_block(s, &dind[fbn / p], create);
+    return ind == NULL ? NULL : &ind[fbn % p];
+  }
+  return NULL;
+}
+
+// the slot holding the block number of block fbn of file k, allocating the index blocks on the way if create is set
+// returns NULL if fbn is past the largest file or a needed index block does not exist
+// with create set the slot is marked dirty, since the caller is about to fill it
+int * bmap (filesystem * s, int k, int64_t fbn, int create) {
+  int *slot = bmap_slot(s, k, fbn, create);
+  if (create && slot != NULL) {
+    mark_dirty(s, slot, sizeof(int));
+  }
+  return slot;
+}
+
+// the block holding block fbn of file k, copied first if another file shares it, so it can be written
+// returns -1 if the file has no such block or there is no space for the copy
+int writable_block (filesystem * s, int k, int64_t fbn) {
+  int *slot = bmap(s, k, fbn, 1);                 // copying any shared index block on the way
+  if (slot == NULL || *slot == -1) {
+    return -1;
+  }
+  if (block_refs(s, *slot) > 0 && private_block(s, slot, 0) == -1) {
+    return -1;
+  }
+  return *slot;
+}
+
+// taking one more reference to every block node points at
+void share_tree (filesystem * s, inode * node) {
+  for (int j = 0; j < TOTAL_BLOCKPTRS; j++) {
+    if (node->blockptrs[j] != -1) {
+      block_share(s, node->blockptrs[j]);
+    }
+  }
+  if (node->indirect != -1) {
+    block_share(s, node->indirect);             // every block below it is shared through it
+  }
+  if (node->dindirect != -1) {
+    block_share(s, node->dindirect);
+  }
+}
+
+// sharing every block of file src with file k, which has none yet, and copying the content kept in its inode
+void share_blocks (filesystem * s, int k, int src) {
+  inode *from = &(*s).inodes[src], *to = &(*s).inodes[k];
+  share_tree(s, from);
+  memcpy(to->blockptrs, from->blockptrs, sizeof(to->blockptrs));
+  to->indirect = from->indirect;
+  to->dindirect = from->dindirect;
+  to->blocks = from->blocks;
+  memcpy(to->data, from->data, INLINE_MAX);
+  inode_dirty(s, k);
+}
+
+// mapping block b as the next block of file k, returns -1 if there is no space for an index block it needs
+int append_block (filesystem * s, int k, int b) {
+  int *slot = bmap(s, k, (*s).inodes[k].blocks, 1);
+  if (slot == NULL) {
+    return -1;
+  }
+  *slot = b;
+  (*s).inodes[k].blocks++;
+  return 0;
+}
+
+// adding nblocks data blocks to the end of file k, in runs as long as the free space allows so the file is laid out sequentially
+// the caller checks that the data and index blocks fit, but other threads may take the space first, so this returns -1
+// once no block at all is left, with the blocks mapped so far counted in the file for the caller to release
+int alloc_file_blocks (filesystem * s, int k, int64_t nblocks) {
+  int64_t done = 0;
+  int64_t want = nblocks;                             // length of the run asked for next
+  while (done < nblocks) {
+    if (want > nblocks - done) {
+      want = nblocks - done;
+    }
+    int b = alloc_run(s, want);
+    if (b == -1) {
+      if (want == 1) {
+        inode_dirty(s, k);
+        return -1;
+      }
+      want = want / 2;                                // no run that long is free, trying a shorter one
+      continue;
+    }
+    for (int64_t j = 0; j < want; j++) {
+      if (append_block(s, k, b + j) == -1) {          // index blocks come from after the run, keeping the data contiguous
+        for (; j < want; j++) {
+          free_block(s, b + j);                       // no room left for the index block, handing back the rest of the run
+        }
+        inode_dirty(s, k);
+        return -1;
+      }
+    }
+    done += want;
+  }
+  inode_dirty(s, k);
+  return 0;
+}
+
+// releasing an index block and every block below it, level 1 points at data blocks and level 2 at indirect blocks
+void free_index (filesystem * s, int b, int level) {
+  if (block_unshare(s, b)) {
+    return;                                     // another file still reaches everything below it
+  }
+  int *ptrs = (int *)block_at(s, b);
+  for (int64_t i = 0; i < ptrs_per_block(s); i++) {
+    if (ptrs[i] != -1) {
+      if (level == 1) {
+        free_block(s, ptrs[i]);
+      } else {
+        free_index(s, ptrs[i], level - 1);
+      }
+    }
+  }
+  free_block(s, b);
+}
+
+// dropping the references node holds to its blocks, without changing node
+void free_tree (filesystem * s, inode * node) {
+  for (int j = 0; j < TOTAL_BLOCKPTRS; j++) {
+    if (node->blockptrs[j] != -1) {
+      free_block(s, node->blockptrs[j]);
+    }
+  }
+  if (node->indirect != -1) {
+    free_index(s, node->indirect, 1);
+  }
+  if (node->dindirect != -1) {
+    free_index(s, node->dindirect, 2);
+  }
+}
+
+// releasing every block of file k
+void free_file_blocks (filesystem * s, int k) {
+  free_tree(s, &(*s).inodes[k]);
+  memset((*s).inodes[k].blockptrs, 0xff, sizeof((*s).inodes[k].blockptrs));     // every pointer back to -1
+  (*s).inodes[k].indirect = -1;
+  (*s).inodes[k].dindirect = -1;
+  (*s).inodes[k].blocks = 0;
+  inode_dirty(s, k);
+}
+
+// directories
+// the entries of directory d are packed into its blocks, which are found through bmap like a file's
+// by default the entries form an array, appended at the end and removed by moving the last entry into the hole
+// with FS_HASHED_DIRS they form an open addressed hash table with linear probing, the table doubles when it is
+// three quarters full so lookups stay constant time however large the directory gets
+
+// number of entries that fit in one block
+int dirents_per_block (filesystem * s) {
+  return (*s).sb->block_size / sizeof(dirent);
+}
+
+// slot i of directory d, NULL if the block holding it was never allocated
+dirent * dir_slot (filesystem * s, int d, int64_t i) {
+  int per = dirents_per_block(s);
+  int *slot = bmap(s, d, i / per, 0);
+  if (slot == NULL || *slot == -1) {
+    return NULL;
+  }
+  return (dirent *)block_at(s, *slot) + i % per;
+}
+
+// number of slots directory d has room for
+int64_t dir_capacity (filesystem * s, int d) {
+  return (int64_t)(*s).inodes[d].blocks * dirents_per_block(s);
+}
+
+// checking if a slot holds the entry with this name
+int dirent_matches (dirent * e, const char * name) {
+  return e->namelen != 0 && strncmp(e->name, name, FILENAME_MAXLEN) == 0;
+}
+
+// finding the slot of the entry called name in directory d, returns -1 if there is none
+int64_t dir_find (filesystem * s, int d, const char * name) {
+  if ((*s).inodes[d].entries == 0) {
+    return -1;
+  }
+  if ((*s).sb->flags & FS_HASHED_DIRS) {
+    int64_t mask = dir_capacity(s, d) - 1;
+    for (int64_t i = name_hash(name, 0) & mask; ; i = (i + 1) & mask) {     // probing from the home slot
+      dirent *e = dir_slot(s, d, i);
+      if (e->namelen == 0) {
+        return -1;                                    // reached an empty slot, so the name is not here
+      }
+      if (dirent_matches(e, name)) {
+        return i;
+      }
+    }
+  }
+  for (int64_t i = 0; i < (*s).inodes[d].entries; i++) {
+    if (dirent_matches(dir_slot(s, d, i), name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// the next entry of directory d at or after slot *pos, advancing *pos past it, NULL once there are no more
+dirent * dir_next (filesystem * s, int d, int64_t * pos) {
+  int64_t end = ((*s).sb->flags & FS_HASHED_DIRS) ? dir_capacity(s, d) : (*s).inodes[d].entries;
+  while (*pos < end) {
+    dirent *e = dir_slot(s, d, (*pos)++);
+    if (e->namelen != 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// giving directory d its own copy of every block it shares with a snapshot, so its entries can be changed
+// a snapshot shares only the pointers in the inode, and the first change copies the whole directory, so a directory
+// that holds no shared pointer has no shared block anywhere below, returns -1 if there is no space for the copies
+int dir_private (filesystem * s, int d) {
+  inode *dir = &(*s).inodes[d];
+  int shared = (dir->indirect != -1 && block_refs(s, dir->indirect) > 0) ||
+               (dir->dindirect != -1 && block_refs(s, dir->dindirect) > 0);
+  for (int j = 0; j < TOTAL_BLOCKPTRS; j++) {
+    shared = shared || (dir->blockptrs[j] != -1 && block_refs(s, dir->blockptrs[j]) > 0);
+  }
+  for (int64_t fbn = 0; shared && fbn < dir->blocks; fbn++) {
+    if (writable_block(s, d, fbn) == -1) {
+      return -1;                                    // the blocks copied so far hold the same entries, nothing is lost
+    }
+  }
+  return 0;
+}
+
+// filling slot e with the entry for inode k
+void dirent_set (dirent * e, int k, filesystem * s) {
+  memcpy(e->name, (*s).inodes[k].name, FILENAME_MAXLEN);
+  e->namelen = strnlen((*s).inodes[k].name, FILENAME_MAXLEN);
+  e->inode = k;
+  mark_dirty(s, e, sizeof(dirent));
+}
+
+// putting inode k in the first free slot of a hashed directory d after its home slot
+void dir_hash_insert (filesystem * s, int d, int k) {
+  int64_t mask = dir_capacity(s, d) - 1;
+  int64_t i = name_hash((*s).inodes[k].name, 0) & mask;
+  while (dir_slot(s, d, i)->namelen != 0) {
+    i = (i + 1) & mask;
+  }
+  dirent_set(dir_slot(s, d, i), k, s);
+}
+
+// doubling the hash table of directory d and putting every entry back in, returns -1 if there is no space
+// the larger table is filled in fresh blocks before the old ones are released, so a failure leaves d as it was
+int dir_grow (filesystem * s, int d) {
+  inode *dir = &(*s).inodes[d];
+  int64_t old_blocks = dir->blocks;
+  int64_t new_blocks = old_blocks == 0 ? 1 : old_blocks * 2;
+  if (new_blocks > max_file_blocks(s) || new_blocks + index_blocks(s, new_blocks) > free_block_count(s)) {
+    return -1;
+  }
+  int n = dir->entries;
+  int *children = malloc((n > 0 ? n : 1) * sizeof(int));       // holding on to the entries while the blocks are replaced
+  if (children == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  int64_t pos = 0;
+  dirent *e;
+  for (int c = 0; (e = dir_next(s, d, &pos)) != NULL; c++) {
+    children[c] = e->inode;
+  }
+  inode old;                                        // the old table, released once the new one holds every entry
+  memcpy(old.blockptrs, dir->blockptrs, sizeof(old.blockptrs));     // only the pointers, a thread looking for a free inode may touch used
+  old.indirect = dir->indirect;
+  old.dindirect = dir->dindirect;
+  old.blocks = dir->blocks;
+  memset(dir->blockptrs, 0xff, sizeof(dir->blockptrs));
+  dir->indirect = -1;
+  dir->dindirect = -1;
+  dir->blocks = 0;
+  if (alloc_file_blocks(s, d, new_blocks) == -1) {  // fresh blocks are zeroed, so every slot starts out empty
+    free_file_blocks(s, d);                         // another thread took the space, going back to the old table
+    memcpy(dir->blockptrs, old.blockptrs, sizeof(dir->blockptrs));
+    dir->indirect = old.indirect;
+    dir->dindirect = old.dindirect;
+    dir->blocks = old.blocks;
+    inode_dirty(s, d);
+    free(children);
+    return -1;
+  }
+  for (int c = 0; c < n; c++) {
+    dir_hash_insert(s, d, children[c]);
+  }
+  free(children);
+  free_tree(s, &old);
+  return 0;
+}
+
+// adding an entry for inode k, which already has its name, to directory d, returns -1 if there is no space
+int dir_add (filesystem * s, int d, int k) {
+  inode *dir = &(*s).inodes[d];
+  if ((*s).sb->flags & FS_HASHED_DIRS) {
+    if ((int64_t)(dir->entries + 1) * 4 > dir_capacity(s, d) * 3) {
+      if (dir_grow(s, d) == -1) {
+        return -1;                                  // the table would be more than three quarters full
+      }
+    } else if (dir_private(s, d) == -1) {           // a grown table has fresh blocks of its own
+      return -1;
+    }
+    dir_hash_insert(s, d, k);
+  } else {
+    if (dir_private(s, d) == -1) {
+      return -1;
+    }
+    if (dir->entries == dir_capacity(s, d)) {       // every block is full, spilling into a new one
+      if ((int64_t)dir->blocks + 1 > max_file_blocks(s) || free_block_count(s) < 3) {
+        return -1;                                  // room for the block and up to two index blocks above it
+      }
+      if (alloc_file_blocks(s, d, 1) == -1) {
+        return -1;                                  // taken by another thread since the check, nothing was added
+      }
+    }
+    dirent_set(dir_slot(s, d, dir->entries), k, s);
+  }
+  dir->entries++;
+  inode_dirty(s, d);
+  return 0;
+}
+
+// releasing the last data block of file k, along with any index block that no longer points anywhere
+void free_last_block (filesystem * s, int k) {
+  int64_t p = ptrs_per_block(s);
+  int64_t fbn = --(*s).inodes[k].blocks;          // the block being dropped
+  int *slot = bmap(s, k, fbn, 0);
+  free_block(s, *slot);
+  *slot = -1;
+  mark_dirty(s, slot, sizeof(int));
+  inode_dirty(s, k);
+  if (fbn == TOTAL_BLOCKPTRS) {                    // it was the first block behind the indirect block
+    free_block(s, (*s).inodes[k].indirect);
+    (*s).inodes[k].indirect = -1;
+  } else if (fbn >= TOTAL_BLOCKPTRS + p && (fbn - TOTAL_BLOCKPTRS - p) % p == 0) {
+    int64_t rel = fbn - TOTAL_BLOCKPTRS - p;       // it was the first block behind one of the double indirect's blocks
+    int *dind = (int *)block_at(s, (*s).inodes[k].dindirect);
+    free_block(s, dind[rel / p]);
+    dind[rel / p] = -1;
+    mark_dirty(s, &dind[rel / p], sizeof(int));
+    if (rel == 0) {
+      free_block(s, (*s).inodes[k].dindirect);
+      (*s).inodes[k].dindirect = -1;
+    }
+  }
+}
+
+// removing the entry called name from directory d, which dir_private has already made its own
+void dir_unlink (filesystem * s, int d, const char * name) {
+  inode *dir = &(*s).inodes[d];
+  int64_t i = dir_find(s, d, name);
+  if (i == -1) {
+    return;
+  }
+  if ((*s).sb->flags & FS_HASHED_DIRS) {
+    // shifting later entries of the probe run back into the hole, so lookups never stop early at it
+    int64_t mask = dir_capacity(s, d) - 1;
+    memset(dir_slot(s, d, i), 0, sizeof(dirent));
+    mark_dirty(s, dir_slot(s, d, i), sizeof(dirent));
+    for (int64_t j = (i + 1) & mask; ; j = (j + 1) & mask) {
+      dirent *e = dir_slot(s, d, j);
+      if (e->namelen == 0) {
+        break;
+      }
+      int64_t home = name_hash(e->name, 0) & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {     // the hole lies between its home slot and where it sits
+        *dir_slot(s, d, i) = *e;
+        mark_dirty(s, dir_slot(s, d, i), sizeof(dirent));
+        memset(e, 0, sizeof(dirent));
+        mark_dirty(s, e, sizeof(dirent));
+        i = j;
+      }
+    }
+  } else {
+    int64_t last = dir->entries - 1;
+    *dir_slot(s, d, i) = *dir_slot(s, d, last);        // moving the last entry into the hole
+    mark_dirty(s, dir_slot(s, d, i), sizeof(dirent));
+    memset(dir_slot(s, d, last), 0, sizeof(dirent));
+    mark_dirty(s, dir_slot(s, d, last), sizeof(dirent));
+    if (last % dirents_per_block(s) == 0) {
+      free_last_block(s, d);                          // the last block has nothing left in it
+    }
+  }
+  dir->entries--;
+  inode_dirty(s, d);
+}
+
+// removing the entry for inode k from directory d
+void dir_remove (filesystem * s, int d, int k) {
+  dir_unlink(s, d, (*s).inodes[k].name);
+}
+
+// file content
+// a file holds the letters a to z repeated, byte i being 'a' + i % 26, copied out of a table that repeats them long
+// enough for any starting letter to be followed by FILL_SPAN bytes, so filling a block is one or two memcpy calls
+
+char fill_pattern[FILL_PERIOD + FILL_SPAN];
+pthread_once_t fill_once = PTHREAD_ONCE_INIT;
+
+void fill_init () {
+  for (int i = 0; i < FILL_PERIOD + FILL_SPAN; i++) {
+    fill_pattern[i] = 'a' + i % FILL_PERIOD;
+  }
+}
+
+// writing the len bytes of content that start at byte offset of a file to data
+void fill_content (char * data, uint64_t offset, uint64_t len) {
+  pthread_once(&fill_once, fill_init);
+  const char *from = fill_pattern + offset % FILL_PERIOD;       // the table from the letter at offset on
+  while (len > 0) {
+    uint64_t n = len < FILL_SPAN ? len : FILL_SPAN;             // a whole number of periods unless it is the last piece
+    memcpy(data, from, n);
+    data += n;
+    len -= n;
+  }
+}
+
+// deduplication
+// with FS_DEDUP every full block of file content is looked up by its content hash before it is stored, and a block
+// that is already on the disk is shared through the reference counts instead, as if the file had been copied
+// a block's content is checked byte for byte before it is shared, so two contents with the same hash stay apart
+// the content of CR is the fill pattern, so its blocks are matched against the pattern without being written first,
+// and a disk of such files keeps one block for each letter a block can start on
+
+// the content hash of a block of bs bytes
+uint32_t dedup_hash (const char * block, uint32_t bs) {
+  return journal_sum(DEDUP_SEED, block, bs);
+}
+
+// the content hash of a full block of file content from byte offset, worked out once for each letter
+uint32_t pattern_hash (filesystem * s, uint64_t offset) {
+  uint64_t *known = &(*s).pattern_hash[offset % FILL_PERIOD];
+  uint64_t h = __atomic_load_n(known, __ATOMIC_RELAXED);
+  if (h >> 32) {
+    return h;
+  }
+  uint64_t buf[FILL_SPAN / sizeof(uint64_t)];        // the pattern a piece at a time, aligned for journal_sum
+  h = DEDUP_SEED;
+  for (uint64_t done = 0; done < (*s).sb->block_size; ) {
+    uint64_t n = (*s).sb->block_size - done < FILL_SPAN ? (*s).sb->block_size - done : FILL_SPAN;
+    fill_content((char *)buf, offset + done, n);
+    h = journal_sum(h, buf, n);
+    done += n;
+  }
+  __atomic_store_n(known, (uint64_t)1 << 32 | (uint32_t)h, __ATOMIC_RELAXED);
+  return h;
+}
+
+// checking if the len bytes of data are the file content from byte offset
+int fill_matches (const char * data, uint64_t offset, uint64_t len) {
+  pthread_once(&fill_once, fill_init);
+  const char *from = fill_pattern + offset % FILL_PERIOD;
+  while (len > 0) {
+    uint64_t n = len < FILL_SPAN ? len : FILL_SPAN;
+    if (memcmp(data, from, n) != 0) {
+      return 0;
+    }
+    data += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// taking a reference to a block in the dedup table with the given hash and content, returns -1 if there is none
+// content is the bytes of the block, or NULL for the file content from byte offset pattern
+int dedup_share (filesystem * s, uint32_t hash, const char * content, uint64_t pattern) {
+  uint32_t bs = (*s).sb->block_size;
+  pthread_mutex_lock(&(*s).dedup_lock);
+  for (uint32_t i = hash & (*s).dedup_mask; (*s).dedup[i].block != 0; i = (i + 1) & (*s).dedup_mask) {
+    dedup_entry *e = &(*s).dedup[i];
+    char *block = block_at(s, e->block);
+    if (e->hash == hash && (content != NULL ? memcmp(block, content, bs) == 0 : fill_matches(block, pattern, bs))) {
+      block_share(s, e->block);
+      pthread_mutex_unlock(&(*s).dedup_lock);
+      STAT(dedup_hits, 1);
+      return e->block;
+    }
+  }
+  pthread_mutex_unlock(&(*s).dedup_lock);
+  STAT(dedup_misses, 1);
+  return -1;
+}
+
+// entering full block b, which a file has just filled, in the dedup table, which takes a reference of its own
+// the table stays at most three quarters full, so a lookup always reaches an empty slot
+void dedup_insert (filesystem * s, int b, uint32_t hash) {
+  pthread_mutex_lock(&(*s).dedup_lock);
+  if (((*s).dedup_used + 1) * 4 <= ((*s).dedup_mask + 1) * 3) {
+    uint32_t i = hash & (*s).dedup_mask;
+    while ((*s).dedup[i].block != 0) {
+      i = (i + 1) & (*s).dedup_mask;
+    }
+    (*s).dedup[i] = (dedup_entry){hash, b};
+    mark_dirty(s, &(*s).dedup[i], sizeof(dedup_entry));
+    (*s).dedup_used++;
+    __atomic_or_fetch(&(*s).pinned[b / 64], (uint64_t)1 << (b % 64), __ATOMIC_RELAXED);
+    block_share(s, b);
+  }
+  pthread_mutex_unlock(&(*s).dedup_lock);
+}
+
+// taking block b out of the dedup table and freeing it, once the table's is the only reference left
+void dedup_evict (filesystem * s, int b) {
+  pthread_mutex_lock(&(*s).dedup_lock);
+  if (block_refs(s, b) != 0 || !((__atomic_load_n(&(*s).pinned[b / 64], __ATOMIC_RELAXED) >> (b % 64)) & 1)) {
+    pthread_mutex_unlock(&(*s).dedup_lock);      // shared again through the table since the count dropped
+    return;
+  }
+  uint32_t mask = (*s).dedup_mask;
+  uint32_t i = dedup_hash(block_at(s, b), (*s).sb->block_size) & mask;
+  while ((*s).dedup[i].block != (uint32_t)b && (*s).dedup[i].block != 0) {
+    i = (i + 1) & mask;
+  }
+  if ((*s).dedup[i].block == (uint32_t)b) {
+    // shifting later entries of the probe run back into the hole, the same as in a hashed directory
+    memset(&(*s).dedup[i], 0, sizeof(dedup_entry));
+    mark_dirty(s, &(*s).dedup[i], sizeof(dedup_entry));
+    for (uint32_t j = (i + 1) & mask; (*s).dedup[j].block != 0; j = (j + 1) & mask) {
+      uint32_t home = (*s).dedup[j].hash & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        (*s).dedup[i] = (*s).dedup[j];
+        mark_dirty(s, &(*s).dedup[i], sizeof(dedup_entry));
+        memset(&(*s).dedup[j], 0, sizeof(dedup_entry));
+        mark_dirty(s, &(*s).dedup[j], sizeof(dedup_entry));
+        i = j;
+      }
+    }
+    (*s).dedup_used--;
+  }
+  __atomic_and_fetch(&(*s).pinned[b / 64], ~((uint64_t)1 << (b % 64)), __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&(*s).dedup_lock);
+  STAT(dedup_evictions, 1);
+  free_block(s, b);
+}
+
+// giving file k, which has no blocks yet, its size bytes of content, every full block shared through the dedup table
+// only the last partial block and content the table does not have take new blocks, returns -1 if the disk is full
+// with the blocks mapped so far counted in the file for the caller to release
+int dedup_fill (filesystem * s, int k, int64_t size) {
+  uint32_t bs = (*s).sb->block_size;
+  int64_t nblocks = file_blocks(s, size);
+  for (int64_t fbn = 0; fbn < nblocks; fbn++) {
+    uint64_t offset = (uint64_t)fbn * bs;
+    uint64_t len = size - offset < bs ? size - offset : bs;
+    uint32_t hash = len == bs ? pattern_hash(s, offset) : 0;
+    int b = len == bs ? dedup_share(s, hash, NULL, offset) : -1;
+    int fresh = b == -1;
+    if (fresh) {
+      b = alloc_block(s);
+      if (b == -1) {
+        inode_dirty(s, k);
+        return -1;
+      }
+      fill_content(block_at(s, b), offset, len);   // the rest of the last block stays zero
+      mark_dirty(s, block_at(s, b), bs);
+      STAT(bytes_written, len);
+    }
+    if (append_block(s, k, b) == -1) {
+      free_block(s, b);
+      inode_dirty(s, k);
+      return -1;
+    }
+    if (fresh && len == bs) {
+      dedup_insert(s, b, hash);
+    }
+  }
+  inode_dirty(s, k);
+  return 0;
+}
+
+// sharing the full blocks [first, end) of file k, which a write has just filled and which are the file's own, with
+// blocks holding the same content, and entering the ones the table does not have
+void dedup_written (filesystem * s, int k, int64_t first, int64_t end) {
+  uint32_t bs = (*s).sb->block_size;
+  for (int64_t fbn = first; fbn < end; fbn++) {
+    int *slot = bmap(s, k, fbn, 0);
+    int b = *slot;
+    uint32_t hash = dedup_hash(block_at(s, b), bs);
+    int c = dedup_share(s, hash, block_at(s, b), 0);
+    if (c == -1) {
+      dedup_insert(s, b, hash);
+      continue;
+    }
+    *slot = c;
+    mark_dirty(s, slot, sizeof(int));
+    free_block(s, b);
+  }
+}
+
+// file I/O
+// a byte offset maps to block offset/block_size of the file through bmap, and the blocks of a file usually lie one
+// after the other on the disk, so a span is copied one run of neighbouring blocks at a time, each run with one memcpy
+
+// the block holding block fbn of file k, with *count set to how many blocks from there, at most max, follow it on the disk
+int block_run (filesystem * s, int k, int64_t fbn, int64_t max, int64_t * count) {
+  int b = *bmap(s, k, fbn, 0);
+  int64_t n = 1;
+  while (n < max && *bmap(s, k, fbn + n, 0) == b + n) {
+    n++;
+  }
+  *count = n;
+  return b;
+}
+
+// putting back the content of file k in its inode after a write that moved it to a block ran out of space
+void unspill (filesystem * s, int k, const char * spilled) {
+  free_file_blocks(s, k);
+  memcpy((*s).inodes[k].data, spilled, INLINE_MAX);
+  inode_dirty(s, k);
+}
+
+// reading up to len bytes of file k from byte offset into buf, returns the number of bytes read, 0 past the end
+// the caller holds the lock of the file's directory
+int64_t file_pread (filesystem * s, int k, char * buf, uint64_t len, uint64_t offset) {
+  uint64_t size = (*s).inodes[k].size;
+  if (offset >= size) {
+    return 0;
+  }
+  if (len > size - offset) {
+    len = size - offset;                                   // stopping at the end of the file
+  }
+  if (size <= INLINE_MAX) {
+    memcpy(buf, (*s).inodes[k].data + offset, len);        // the content is in the inode
+    STAT(bytes_read, len);
+    return len;
+  }
+  uint32_t bs = (*s).sb->block_size;
+  int64_t fbn = offset / bs, last = (offset + len - 1) / bs;
+  uint64_t skip = offset % bs, done = 0;                   // bytes of the first block before offset
+  while (done < len) {
+    int64_t count;
+    int b = block_run(s, k, fbn, last - fbn + 1, &count);
+    uint64_t n = count * bs - skip;
+    n = n < len - done ? n : len - done;
+    memcpy(buf + done, block_at(s, b) + skip, n);
+    done += n;
+    fbn += count;
+    skip = 0;
+  }
+  STAT(bytes_read, len);
+  return len;
+}
+
+// writing the len bytes of buf to file k at byte offset, growing the file if they go past its end
+// the blocks the write covers are copied first if they are shared, and a gap left before offset reads as zeroes
+// a file that stays small enough is written in its inode, one that outgrows it moves its content to a block first
+// with FS_DEDUP the blocks the write fills completely are shared with any block already holding the same content
+// the caller holds the lock of the file's directory, a write that does not fit changes nothing and returns FS_ENOSPC
+int file_pwrite (filesystem * s, int k, const char * buf, uint64_t len, uint64_t offset) {
+  if (len == 0) {
+    return FS_OK;
+  }
+  uint32_t bs = (*s).sb->block_size;
+  uint64_t size = (*s).inodes[k].size;
+  uint64_t end = offset + len > size ? offset + len : size;     // the size of the file once the write is done
+  int64_t have = (*s).inodes[k].blocks;
+  int64_t need = (end + bs - 1) / bs;                      // blocks the file has once the write is done
+  if (offset > (uint64_t)max_file_blocks(s) * bs || need > max_file_blocks(s)) {
+    printf("File size must be between 0 and %lld bytes.\n", (long long)(max_file_blocks(s) * bs));
+    return FS_EINVAL;
+  }
+  if (end <= INLINE_MAX) {
+    memcpy((*s).inodes[k].data + offset, buf, len);        // a gap before offset is already zero
+    STAT(bytes_written, len);
+    STAT(bytes_inline, len);
+    (*s).inodes[k].size = end;
+    inode_dirty(s, k);
+    if (end > size) {
+      propagate_size(k, end - size, 0, s);
+    }
+    return FS_OK;
+  }
+  char spilled[INLINE_MAX];                                // the inline content, kept until the write is sure to fit
+  if (size <= INLINE_MAX) {
+    if (1 + index_blocks(s, 1) > free_block_count(s) || alloc_file_blocks(s, k, 1) == -1) {
+      free_file_blocks(s, k);
+      printf("No space left in the data block.\n");
+      return FS_ENOSPC;
+    }
+    memcpy(spilled, (*s).inodes[k].data, INLINE_MAX);
+    char *data = block_at(s, *bmap(s, k, 0, 0));
+    memcpy(data, spilled, size);
+    mark_dirty(s, data, bs);
+    memset((*s).inodes[k].data, 0, INLINE_MAX);
+    inode_dirty(s, k);
+    have = 1;
+  }
+  int64_t first = offset / bs;
+  for (int64_t fbn = first; fbn < have && fbn < need; fbn++) {
+    if (writable_block(s, k, fbn) == -1) {                 // a copy with the same content, so nothing is lost if this fails
+      if (size <= INLINE_MAX) {
+        unspill(s, k, spilled);
+      }
+      printf("No space left in the data block.\n");
+      return FS_ENOSPC;
+    }
+  }
+  if (need > have) {
+    int64_t grow = need - have;
+    if (grow + index_blocks(s, need) - index_blocks(s, have) > free_block_count(s) || alloc_file_blocks(s, k, grow) == -1) {
+      while ((*s).inodes[k].blocks > have) {
+        free_last_block(s, k);                             // handing back what was claimed before the space ran out
+      }
+      if (size <= INLINE_MAX) {
+        unspill(s, k, spilled);
+      }
+      printf("No space left in the data block.\n");
+      return FS_ENOSPC;
+    }
+  }
+
+  int64_t fbn = first;
+  uint64_t skip = offset % bs, done = 0;
+  while (done < len) {
+    int64_t count;
+    int b = block_run(s, k, fbn, need - fbn, &count);
+    uint64_t n = count * bs - skip;
+    n = n < len - done ? n : len - done;
+    memcpy(block_at(s, b) + skip, buf + done, n);
+    mark_dirty(s, block_at(s, b) + skip, n);
+    done += n;
+    fbn += count;
+    skip = 0;
+  }
+  STAT(bytes_written, len);
+  if ((*s).sb->flags & FS_DEDUP) {
+    uint64_t touched = (offset + len + bs - 1) / bs, full = end / bs;     // blocks up to the last one written, and the full ones
+    int64_t last = (int64_t)(touched < full ? touched : full);   // both at most need, which is checked above
+    dedup_written(s, k, first, last);                      // the blocks this write touched, unless the file ends inside one
+  }
+
+  int64_t grown = (int64_t)(offset + len) - (*s).inodes[k].size;
+  if (grown > 0) {
+    (*s).inodes[k].size += grown;
+    inode_dirty(s, k);
+    propagate_size(k, grown, 0, s);                           // the directories above it grow with it
+  }
+  return FS_OK;
+}
+
+//functions
+// creating the file at filename, filled with filesize bytes of content, or sharing the blocks of file source unless it is -1
+// generation is the one source had when it was found
+int make_file (char * filename, char * filesize, int source, uint32_t generation, filesystem * s) {
+  // creating a path array that contains each directory or file from the abosulute path 
+  char *path[MAX_DEPTH];
+  int i = split_path(filename, path);
+  if (i == -1) {
+    return FS_EINVAL;
+  }
+
+  if(strlen(path[i-1]) > FILENAME_MAXLEN) {                       // path[i-1] is the name of the file to be created
+    printf("Name of the file cannot exceed 8 characters.\n");     // failing if length of the name exceeds 8 characters
+    return FS_ENAMETOOLONG;
+  }
+
+  char *end = "";
+  int64_t size = source == -1 ? strtoll(filesize, &end, 10) : 0;      // converting the size to integer, a copy takes its source's
+  int64_t nblocks = file_blocks(s, size);                 // blocks needed for the content, none if it fits in the inode
+  if (*end != '\0' || size < 0 || nblocks > max_file_blocks(s)) {
+    printf("File size must be between 0 and %lld bytes.\n", (long long)(max_file_blocks(s) * (*s).sb->block_size));
+    return FS_EINVAL;
+  }
+
+  int failed;
+  uint32_t found;
+  int previous = walk_path(path, i - 1, s, &failed, &found);       // resolving the parent directory through the path index
+  if (previous == -1 || (*s).inodes[previous].dir != 1) {
+    printf("The directory %s at the given path does not exist.\n", path[previous == -1 ? failed : i-2]);    // error checking for wrong path
+    return FS_ENOENT;
+  }
+  int held = source == -1 ? previous : (*s).inodes[source].parent;     // the source's directory is held too
+  if (held == -1) {
+    printf("The file does not exist.\n");
+    return FS_ENOENT;
+  }
+  lock_pair(s, previous, held);            // holding the directory until the file is complete
+  if (!inode_current(s, previous, found) || (*s).inodes[previous].dir != 1) {
+    unlock_pair(s, previous, held);
+    printf("The directory %s at the given path does not exist.\n", path[i-2]);   // removed by another thread since the walk
+    return FS_ENOENT;
+  }
+  if (source != -1 && (!inode_current(s, source, generation) || (*s).inodes[source].parent != held)) {
+    unlock_pair(s, previous, held);
+    printf("The file does not exist.\n");        // the source was removed or moved since the walk
+    return FS_ENOENT;
+  }
+  if (source != -1) {
+    size = (*s).inodes[source].size;
+  }
+
+  if(index_lookup(previous, path[i-1], s) != -1) {
+    unlock_pair(s, previous, held);
+    printf("The file already exists.\n");
+    return FS_EEXIST;                              // failing if the file already exists in its directory
+  }
+
+  TRACE(TRACE_DEBUG, "Element in create file: %d: %s\n", i-1, trace_name(path[i-1]));      // to trace the file being created
+  TRACE(TRACE_DEBUG, "Parent value in create file: %d \n", previous);
+
+  int k = alloc_inode(s);                      // k will be the inode number which was not used
+  if (k == -1) {
+    unlock_pair(s, previous, held);
+    printf("No Space to create a file.\n");     // failing if all inodes are in use
+    return FS_ENOSPC;
+  }
+
+  // changing the attributes of the new inode
+  (*s).inodes[k].dir = 0;
+  memcpy((*s).inodes[k].name, path[i-1], strlen(path[i-1]));      // a free inode's name is all zeros
+  (*s).inodes[k].size = size;
+  (*s).inodes[k].parent = previous;
+  inode_dirty(s, k);
+
+  if (dir_add(s, previous, k) == -1) {                     // adding the file's entry to its directory
+    free_inode(k, s);
+    unlock_pair(s, previous, held);
+    printf ("No Space left in the data block.\n");      // failing if no space in the datablock
+    return FS_ENOSPC;
+  }
+  TRACE(TRACE_DEBUG, "directory %d now has %d entries in %d blocks \n", previous, (*s).inodes[previous].entries, (*s).inodes[previous].blocks);
+
+  int dedup = source == -1 && nblocks > 0 && ((*s).sb->flags & FS_DEDUP);     // full blocks shared instead of written
+  if (source != -1) {
+    share_blocks(s, k, source);                            // a copy costs no blocks and no time however large the file is
+  } else if (dedup ? dedup_fill(s, k, size) == -1 :
+             nblocks + index_blocks(s, nblocks) > free_block_count(s) || alloc_file_blocks(s, k, nblocks) == -1) {
+    free_file_blocks(s, k);                                // the blocks claimed before another thread took the rest
+    dir_remove(s, previous, k);                            // taking the entry back out
+    free_inode(k, s);
+    unlock_pair(s, previous, held);
+    printf("No space left in the data block.\n");      // the content and its index blocks must fit
+    return FS_ENOSPC;
+  }
+  index_insert(k, s);                    // the file can now be found under its directory
+
+  // changing the size of the directories in the path in accordance with the size of the file
+  propagate_size(k, size, 1, s);
+  if (source != -1) {
+    TRACE(TRACE_INFO, "the inode %.8s shares the %d data blocks of %d \n", trace_name((*s).inodes[k].name), (*s).inodes[k].blocks, source);
+    unlock_pair(s, previous, held);
+    return FS_OK;
+  }
+
+  TRACE(TRACE_DEBUG, "this is the first block for storing alphabets in create file: %d \n", nblocks > 0 ? *bmap(s, k, 0, 0) : -1);
+
+  if (nblocks == 0) {
+    fill_content((*s).inodes[k].data, 0, size);           // a small file is kept in its inode, the rest of data stays zero
+    inode_dirty(s, k);
+    STAT(bytes_inline, size);
+  }
+  uint32_t bs = (*s).sb->block_size;
+  for (int64_t fbn = 0; fbn < nblocks && !dedup; fbn++) {     // dedup_fill has written its blocks already
+    char *data = block_at(s, *bmap(s, k, fbn, 0));            // the block holding this part of the file
+    uint64_t len = size - fbn * bs < bs ? size - fbn * bs : bs;     // the rest of the last block stays zero
+    fill_content(data, (uint64_t)fbn * bs, len);
+    mark_dirty(s, data, bs);
+  }
+  if (!dedup) {
+    STAT(bytes_written, size);
+  }
+  TRACE(TRACE_INFO, "the inode %.8s has %lld data blocks \n", trace_name((*s).inodes[k].name), nblocks);
+  unlock_pair(s, previous, held);
+  return FS_OK;
+}
+
+// create file
+int createfile (char * filename, char * filesize, filesystem * s) {
+  return make_file(filename, filesize, -1, 0, s);
+}
+
+// copy file
+int copyfile (char * sourcefile, char * destfile, filesystem * s){
+  char *path[MAX_DEPTH];                   
+  int i = split_path(sourcefile, path);
+  if (i == -1) {
+    return FS_EINVAL;
+  }
+
+  int failed;
+  uint32_t found;
+  int k = walk_path(path, i, s, &failed, &found);                   // finding the inode of the file to be copied
+  if (k == -1) {
+    printf("The file does not exist.\n");
+    return FS_ENOENT;
+  }
+  if((*s).inodes[k].dir == 1) {
+    printf("Can not handle directories.\n");
+    return FS_EISDIR;
+  }
+  TRACE(TRACE_DEBUG, "this is the size of source file: %lld \n", (*s).inodes[k].size);
+  return make_file(destfile, NULL, k, found, s);      // the copy shares the source's blocks instead of writing them again
+}
+
+// finding the file at the given path and taking the lock of its directory, returns its inode or -1 with *status set
+int lock_file (char * file, filesystem * s, int * status) {
+  char *path[MAX_DEPTH];
+  int i = split_path(file, path);
+  if (i == -1) {
+    *status = FS_EINVAL;
+    return -1;
+  }
+  int failed;
+  uint32_t found;
+  int k = walk_path(path, i, s, &failed, &found);
+  int parent = k == -1 ? -1 : (*s).inodes[k].parent;
+  if (parent == -1) {
+    printf("The file does not exist.\n");
+    *status = FS_ENOENT;
+    return -1;
+  }
+  if ((*s).inodes[k].dir == 1) {
+    printf("Can not handle directories.\n");
+    *status = FS_EISDIR;
+    return -1;
+  }
+  lock_inode(s, parent);
+  if (!inode_current(s, k, found) || (*s).inodes[k].parent != parent) {
+    unlock_inode(s, parent);
+    printf("The file does not exist.\n");        // removed or moved away by another thread since the walk
+    *status = FS_ENOENT;
+    return -1;
+  }
+  return k;
+}
+
+// reading a byte offset or length, returns -1 if text is not a number
+int64_t parse_offset (const char * text) {
+  char *end;
+  int64_t value = strtoll(text, &end, 10);
+  if (end == text || *end != '\0' || value < 0) {
+    printf("Offsets and lengths must be whole numbers of bytes.\n");
+    return -1;
+  }
+  return value;
+}
+
+// write data to a file at an offset
+int writefile (char * file, char * offset, char * data, filesystem * s) {
+  int64_t at = parse_offset(offset);
+  if (at == -1) {
+    return FS_EINVAL;
+  }
+  int status;
+  int k = lock_file(file, s, &status);
+  if (k == -1) {
+    return status;
+  }
+  int parent = (*s).inodes[k].parent;
+  status = file_pwrite(s, k, data, strlen(data), at);
+  TRACE(TRACE_INFO, "wrote %lld bytes at %lld of the inode %.8s \n", (int64_t)strlen(data), at, trace_name((*s).inodes[k].name));
+  unlock_inode(s, parent);
+  return status;
+}
+
+// append data to the end of a file
+int appendfile (char * file, char * data, filesystem * s) {
+  int status;
+  int k = lock_file(file, s, &status);
+  if (k == -1) {
+    return status;
+  }
+  int parent = (*s).inodes[k].parent;
+  int64_t at = (*s).inodes[k].size;                // the end is read under the lock, so appends never overlap
+  status = file_pwrite(s, k, data, strlen(data), at);
+  TRACE(TRACE_INFO, "appended %lld bytes at %lld of the inode %.8s \n", (int64_t)strlen(data), at, trace_name((*s).inodes[k].name));
+  unlock_inode(s, parent);
+  return status;
+}
+
+// read part of a file and print it
+int readfile (char * file, char * offset, char * length, filesystem * s) {
+  int64_t at = parse_offset(offset), len = parse_offset(length);
+  if (at == -1 || len == -1) {
+    return FS_EINVAL;
+  }
+  int status;
+  int k = lock_file(file, s, &status);
+  if (k == -1) {
+    return status;
+  }
+  int parent = (*s).inodes[k].parent;
+  int64_t size = (*s).inodes[k].size;
+  len = at >= size ? 0 : (len < size - at ? len : size - at);      // never more than the file holds
+  char *buf = malloc(len > 0 ? len : 1);
+  if (buf == NULL) {
+    unlock_inode(s, parent);
+    printf("No memory to read %lld bytes.\n", (long long)len);
+    return FS_ENOSPC;
+  }
+  int64_t n = file_pread(s, k, buf, len, at);
+  unlock_inode(s, parent);
+  fwrite(buf, 1, n, stdout);                       // the bytes as they are, a gap that was never written reads as zeroes
+  printf("\n");
+  free(buf);
+  return FS_OK;
+}
+
+// remove/delete fileed
+int removefile (char * file, filesystem * s) {
+  char *path[MAX_DEPTH];             
+  int i = split_path(file, path);
+  if (i == -1) {
+    return FS_EINVAL;
+  }
+
+  char * filename = path[i-1];
+  TRACE(TRACE_DEBUG, "this is the filename: %s \n", trace_name(filename));
+
+  int failed;
+  uint32_t found;
+  int file_inode = walk_path(path, i, s, &failed, &found);       // finding the inode of the file to be deleted
+  if (file_inode == -1){
+    printf("The file does not exist.\n");        // error checking in case the file does not exist
+    return FS_ENOENT;
+  }
+  if ((*s).inodes[file_inode].dir == 1) {
+    printf("Can not handle directories.\n");     // directories are removed with DD
+    return FS_EISDIR;
+  }
+
+  TRACE(TRACE_DEBUG, "this is the file inode: %d \n", file_inode);
+  int parent = (*s).inodes[file_inode].parent;             // the directory which holds the file
+  if (parent == -1) {
+    printf("The file does not exist.\n");        // its directory is being removed
+    return FS_ENOENT;
+  }
+  lock_inode(s, parent);
+  if (!inode_current(s, file_inode, found) || (*s).inodes[file_inode].parent != parent) {
+    unlock_inode(s, parent);
+    printf("The file does not exist.\n");        // removed or moved away by another thread since the walk
+    return FS_ENOENT;
+  }
+  if (dir_private(s, parent) == -1) {
+    unlock_inode(s, parent);
+    printf("No Space left to change the directory.\n");      // it is shared with a snapshot and has to be copied
+    return FS_ENOSPC;
+  }
+  int64_t filesize = (*s).inodes[file_inode].size;             // storing the filesize of the current inode
+  propagate_size(file_inode, -filesize, -1, s);                //subtracting directory size in accordance with the file to be deleted
+
+  dir_remove(s, parent, file_inode);                       // taking the file's entry out of its directory
+  TRACE(TRACE_INFO, "name of parent inode: %.8s, entries left: %d \n", trace_name((*s).inodes[parent].name), (*s).inodes[parent].entries);
+
+  free_file_blocks(s, file_inode);     // freeing the direct, indirect and double indirect blocks of the file
+
+  index_remove(file_inode, s);      // unlinking the file from the path index before its name is cleared
+
+  free_inode(file_inode, s);        // setting all the values of that inode
+  unlock_inode(s, parent);
+  return FS_OK;
+}
+
+// move a file or directory
+// renaming relinks one directory entry, whatever is below a moved directory stays where it is, keyed by its own
+// inode in the path index, so moving a directory of any size costs the same as moving a file
+int movefile (char * source, char * destination, filesystem * s) {
+  // parsing the source 
+  char *path[MAX_DEPTH];                              
+  int i = split_path(source, path);
+
+  // parsing the destination
+  char *path2[MAX_DEPTH];                              
+  int m = split_path(destination, path2);
+  if (i == -1 || m == -1) {
+    return FS_EINVAL;
+  }
+  char *name = path2[m-1];                           // the name it has at the destination
+  if (strlen(name) > FILENAME_MAXLEN) {
+    printf("Name of the file cannot exceed 8 characters.\n");
+    return FS_ENAMETOOLONG;
+  }
+
+  int failed;
+  uint32_t found, found2;
+  int num = walk_path(path, i, s, &failed, &found);          // finding the inode of the file to be moved
+  if (num == -1) {
+    if (failed == i-1) {
+      printf("The file %s does not exist.\n", path[failed]);
+    } else {
+      printf("The directory %s at the source path does not exist.\n", path[failed]);      // in case of invalid path in the source 
+    }
+    return FS_ENOENT;
+  }
+
+  int parent = (*s).inodes[num].parent;           // the previous parent of the file to be moved
+  TRACE(TRACE_DEBUG, "this is the name: %.8s \n", trace_name((*s).inodes[num].name));
+
+  int parent2 = walk_path(path2, m-1, s, &failed, &found2);     // finding inode of parent2 in which the file is to be moved
+  if (parent2 == -1 || (*s).inodes[parent2].dir != 1) {
+    printf("The directory %s at the destination path does not exist.\n", path2[parent2 == -1 ? failed : m-2]);    // in case of invalid path in the destination
+    return FS_ENOENT;
+  }
+  TRACE(TRACE_DEBUG, "found: %.8s \n", trace_name(s->inodes[parent2].name));
+
+  if (parent == -1) {
+    printf("The file %s does not exist.\n", path[i-1]);     // its directory is being removed
+    return FS_ENOENT;
+  }
+  int tree = (*s).inodes[num].dir == 1 && parent != parent2;     // a directory changing parents
+  if (tree) {
+    pthread_mutex_lock(&(*s).rename_lock);
+  }
+  lock_pair(s, parent, parent2);             // both directories change, taken in a fixed order
+  int status = FS_OK;
+  if (!inode_current(s, num, found) || (*s).inodes[num].parent != parent) {
+    printf("The file %s does not exist.\n", path[i-1]);     // removed or moved away by another thread since the walk
+    status = FS_ENOENT;
+  } else if (!inode_current(s, parent2, found2) || (*s).inodes[parent2].dir != 1) {
+    printf("The directory %s at the destination path does not exist.\n", path2[m-2]);
+    status = FS_ENOENT;
+  } else if (index_lookup(parent2, name, s) != -1) {
+    printf("The file already exists at the destination.\n");
+    status = FS_EEXIST;
+  }
+  if (status == FS_OK && tree) {
+    for (int p = parent2; p != -1; p = (*s).inodes[p].parent) {
+      if (p == num) {
+        printf("Can not move a directory into itself.\n");     // it would be cut off from the root
+        status = FS_EINVAL;
+        break;
+      }
+    }
+  }
+  if (status == FS_OK && (dir_private(s, parent) == -1 || dir_private(s, parent2) == -1)) {
+    printf("No Space left to change the directory.\n");        // one of them is shared with a snapshot and has to be copied
+    status = FS_ENOSPC;
+  }
+  if (status != FS_OK) {
+    unlock_pair(s, parent, parent2);
+    if (tree) {
+      pthread_mutex_unlock(&(*s).rename_lock);
+    }
+    return status;
+  }
+
+  char old[FILENAME_MAXLEN];
+  memcpy(old, (*s).inodes[num].name, FILENAME_MAXLEN);
+  index_remove(num, s);                            // unlinking it from the path index before its name or parent changes
+  memset((*s).inodes[num].name, 0, FILENAME_MAXLEN);
+  memcpy((*s).inodes[num].name, name, strlen(name));
+  if (parent == parent2 && !((*s).sb->flags & FS_HASHED_DIRS)) {
+    dirent_set(dir_slot(s, parent, dir_find(s, parent, old)), num, s);      // a rename in place, the slot keeps its position
+  } else if (parent == parent2) {
+    dir_unlink(s, parent, old);                    // the slot depends on the name, and the table never shrinks, so
+    dir_add(s, parent, num);                       // putting it back cannot need more space
+  } else if (dir_add(s, parent2, num) == -1) {     // the new parent gets an entry first
+    memcpy((*s).inodes[num].name, old, FILENAME_MAXLEN);
+    index_insert(num, s);
+    unlock_pair(s, parent, parent2);
+    if (tree) {
+      pthread_mutex_unlock(&(*s).rename_lock);
+    }
+    printf("No Space left in the destination directory.\n");
+    return FS_ENOSPC;
+  } else {
+    dir_unlink(s, parent, old);                    // and the old parent loses its entry
+    pthread_rwlock_wrlock(&(*s).tree_lock);        // no change below it can go up while its summary moves
+    int64_t size = __atomic_load_n(&(*s).inodes[num].size, __ATOMIC_RELAXED);
+    int count = 1 + __atomic_load_n(&(*s).inodes[num].below, __ATOMIC_RELAXED);
+    propagate_locked(num, -size, -count, s);       // the whole file or subtree leaves the old ancestors
+    __atomic_store_n(&(*s).inodes[num].parent, parent2, __ATOMIC_RELAXED);
+    propagate_locked(num, size, count, s);         // and joins the new ones
+    pthread_rwlock_unlock(&(*s).tree_lock);
+  }
+  inode_dirty(s, num);
+  index_insert(num, s);
+  TRACE(TRACE_INFO, "moved the inode %d from %d to %d \n", num, parent, parent2);
+  unlock_pair(s, parent, parent2);
+  if (tree) {
+    pthread_mutex_unlock(&(*s).rename_lock);
+  }
+  return FS_OK;
+}
+
+// list file info
+int listfile (filesystem * s) {
+  for (uint32_t i = 0; i < s->sb->total_inodes; i++){
+    if (s->inodes[i].used == 1){                 // selecting the inodes which are in use
+      if(s->inodes[i].dir == 1){                 // checking if it is a file or a directory
+        printf ("Directory: %.8s Directory size: %lld \n", s->inodes[i].name, (long long)s->inodes[i].size);     // printing name and size of the directory
+      } else if (s->inodes[i].dir == 0) {
+        printf ("File name: %.8s File size: %lld \n", s->inodes[i].name, (long long)s->inodes[i].size);    // printing name and size of the file
+      }
+    }
+  }
+  return FS_OK;
+}
+
+// one directory of a tree listing and the slot its entries are listed up to
+typedef struct list_frame {
+  int dir;
+  int64_t pos;
+  size_t len;                  // length of the directory's path, its entries are listed under it
+} list_frame;
+
+// printing the line for inode k found at path, a directory with what is kept up to date about everything under it
+void list_line (filesystem * s, int k, const char * path) {
+  if ((*s).inodes[k].dir == 1) {
+    printf("Directory: %s Directory size: %lld Entries: %d Below: %d \n", path, (long long)(*s).inodes[k].size,
+           (*s).inodes[k].entries, (*s).inodes[k].below);
+  } else {
+    printf("File name: %s File size: %lld \n", path, (long long)(*s).inodes[k].size);
+  }
+}
+
+// putting "/name" of entry e after the first len bytes of the path in *buf, returns the new length
+size_t list_path (char ** buf, size_t * cap, size_t len, dirent * e) {
+  if (len + 2 + FILENAME_MAXLEN > *cap) {
+    *cap = 2 * (len + 2 + FILENAME_MAXLEN);
+    *buf = realloc(*buf, *cap);
+    if (*buf == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  (*buf)[len] = '/';
+  memcpy(*buf + len + 1, e->name, e->namelen);
+  len += 1 + e->namelen;
+  (*buf)[len] = '\0';
+  return len;
+}
+
+// list the tree under a path depth levels down, or all the way with *, in pages of LIST_PAGE entries
+// the first line is the path itself, whose size and counts cost nothing to print, so depth 0 is a du of the subtree
+// entries stream out in depth first order as the directories are read, only the directories being walked are held
+// a page that stops short ends with a cursor, the slot each of those directories has reached, that carries on from there
+int listtree (char * start, char * levels, char * cursor, filesystem * s) {
+  int depth = 1;                                   // the entries of the directory itself unless asked for more
+  if (levels != NULL && strcmp(levels, "*") == 0) {
+    depth = -1;
+  } else if (levels != NULL) {
+    char *end;
+    long value = strtol(levels, &end, 10);
+    if (end == levels || *end != '\0' || value < 0) {
+      printf("The depth must be a whole number of levels or *.\n");
+      return FS_EINVAL;
+    }
+    depth = value > MAX_DEPTH * 1024 ? -1 : (int)value;
+  }
+
+  size_t cap = 64, len = 0;
+  char *buf = malloc(cap);                         // the path of the entry being listed
+  if (buf == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  buf[0] = '\0';
+  int k = 0;                                       // the root
+  if (strcmp(start, "/") != 0) {
+    char *path[MAX_DEPTH];
+    int i = split_path(start, path);
+    if (i == -1) {
+      free(buf);
+      return FS_EINVAL;
+    }
+    int failed;
+    k = walk_path(path, i, s, &failed, NULL);
+    for (int j = 0; k != -1 && j < i; j++) {
+      dirent e = {.namelen = strnlen(path[j], FILENAME_MAXLEN)};
+      memcpy(e.name, path[j], e.namelen);
+      len = list_path(&buf, &cap, len, &e);
+    }
+  }
+  if (k == -1 || (*s).inodes[k].used == 0) {
+    free(buf);
+    printf("The file or directory does not exist.\n");
+    return FS_ENOENT;
+  }
+  if (cursor == NULL) {
+    list_line(s, k, len == 0 ? "/" : buf);
+  }
+  if (depth == 0 || (*s).inodes[k].dir != 1) {
+    free(buf);
+    return FS_OK;
+  }
+
+  int top = 1, room = 16;
+  list_frame *frames = malloc(room * sizeof(list_frame));      // the directories being walked, from k down
+  if (frames == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  frames[0] = (list_frame){k, 0, len};
+  char *p = cursor;
+  while (p != NULL) {                              // one slot for each directory on the way down
+    char *end = p;
+    list_frame *f = &frames[top - 1];
+    if (p != cursor) {                             // the next directory down is the entry just before where its parent stopped
+      int64_t at = f->pos - 1;
+      dirent *e = at >= 0 ? dir_next(s, f->dir, &at) : NULL;
+      if (e == NULL || at != f->pos || (*s).inodes[e->inode].dir != 1 || top == depth) {
+        f = NULL;
+      } else {
+        if (top == room) {
+          room *= 2;
+          frames = realloc(frames, room * sizeof(list_frame));
+          if (frames == NULL) {
+            perror("realloc");
+            exit(1);
+          }
+        }
+        frames[top] = (list_frame){e->inode, 0, list_path(&buf, &cap, frames[top - 1].len, e)};
+        f = &frames[top++];
+      }
+    }
+    if (f != NULL) {
+      f->pos = strtoll(p, &end, 10);
+    }
+    if (f == NULL || end == p || (*end != '.' && *end != '\0') || f->pos < 0) {
+      free(frames);
+      free(buf);
+      printf("The cursor does not match the tree any more.\n");      // malformed, or the directories changed under it
+      return FS_EINVAL;
+    }
+    p = *end == '.' ? end + 1 : NULL;
+  }
+
+  int listed = 0;
+  while (top > 0) {
+    list_frame *f = &frames[top - 1];
+    int64_t pos = f->pos;
+    dirent *e = dir_next(s, f->dir, &pos);
+    if (e == NULL) {
+      top--;                                       // done with this directory, back to its parent
+      continue;
+    }
+    if (listed == LIST_PAGE) {
+      printf("More: ");                            // the page is full and there is more to come
+      for (int j = 0; j < top; j++) {
+        printf(j == 0 ? "%lld" : ".%lld", (long long)frames[j].pos);
+      }
+      printf(" \n");
+      break;
+    }
+    f->pos = pos;
+    len = list_path(&buf, &cap, f->len, e);
+    list_line(s, e->inode, buf);
+    listed++;
+    if ((*s).inodes[e->inode].dir == 1 && (depth == -1 || top < depth)) {
+      if (top == room) {
+        room *= 2;
+        frames = realloc(frames, room * sizeof(list_frame));
+        if (frames == NULL) {
+          perror("realloc");
+          exit(1);
+        }
+      }
+      frames[top++] = (list_frame){e->inode, 0, len};
+    }
+  }
+  TRACE(TRACE_INFO, "listed %d entries under the inode %d \n", listed, k);
+  free(frames);
+  free(buf);
+  return FS_OK;
+}
+
+// create directory
+int createdirectory (char * directory, filesystem * s) {
+  //seperate condition for creation of root directory as we cannot parse using '/' because then root directory is '/'
+  if (strcmp(directory, "/") == 0){
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&(*s).inodes[0].used, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      printf("The directory already exists.\n");
+      return FS_EEXIST;
+    }                                      // the root always takes the first inode, and was counted free until now
+    __atomic_sub_fetch(&(*s).sb->free_inodes, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&(*s).index.loaded[0], 1, __ATOMIC_RELEASE);     // it starts out empty, so the index holds all of it
+    (*s).inodes[0].dir = 1;
+    strcpy((*s).inodes[0].name, directory);
+    (*s).inodes[0].parent = -1;
+    (*s).inodes[0].size = 0;
+    inode_dirty(s, 0);
+    return FS_OK;
+  }
+
+  char *path[MAX_DEPTH];        
+  int i = split_path(directory, path);
+  if (i == -1) {
+    return FS_EINVAL;
+  }
+
+  if(strlen(path[i-1]) > FILENAME_MAXLEN) {                       // path[i-1] is the name of the directory to be created
+    printf("Name of the file cannot exceed 8 characters.\n");     // failing if length of the name exceeds 8 characters
+    return FS_ENAMETOOLONG;
+  }
+
+  int failed;
+  uint32_t found;
+  int previous = walk_path(path, i - 1, s, &failed, &found);      // resolving the parent directory through the path index
+  if (previous == -1 || (*s).inodes[previous].dir != 1) {
+    printf("The directory %s at the given path does not exist.\n", path[previous == -1 ? failed : i-2]);    // error checking for wrong path
+    return FS_ENOENT;
+  }
+  lock_inode(s, previous);
+  if (!inode_current(s, previous, found) || (*s).inodes[previous].dir != 1) {
+    unlock_inode(s, previous);
+    printf("The directory %s at the given path does not exist.\n", path[i-2]);   // removed by another thread since the walk
+    return FS_ENOENT;
+  }
+
+  if(index_lookup(previous, path[i-1], s) != -1) {
+    unlock_inode(s, previous);
+    printf("The directory already exists.\n");
+    return FS_EEXIST;                              // failing if the directory already exists in its parent
+  }
+
+  TRACE(TRACE_DEBUG, "Element in create directory: %d: %s\n", i-1, trace_name(path[i-1]));
+  TRACE(TRACE_DEBUG, "Parent value in create directory: %d\n", previous);
+
+  int k = alloc_inode(s);               // finding the next empty inode
+  if (k == -1){                         // if all inodes are in use
+    unlock_inode(s, previous);
+    printf("No Space to create directory.\n");
+    return FS_ENOSPC;
+  }
+
+  // changing attributes of the new inode
+  (*s).inodes[k].dir = 1;
+  (*s).inodes[k].size = 0;
+  memcpy((*s).inodes[k].name, path[i-1], strlen(path[i-1]));      // a free inode's name is all zeros
+  (*s).inodes[k].parent = previous;
+  inode_dirty(s, k);
+
+  if (dir_add(s, previous, k) == -1) {        // adding the new directory's entry to its parent
+    free_inode(k, s);
+    unlock_inode(s, previous);
+    printf ("No Space left in the data block \n");
+    return FS_ENOSPC;
+  }
+  TRACE(TRACE_DEBUG, "directory %d now has %d entries in %d blocks \n", previous, (*s).inodes[previous].entries, (*s).inodes[previous].blocks);
+  propagate_size(k, 0, 1, s);  // counted under every directory above it
+  (*s).index.loaded[k] = 1;  // every entry it will ever have goes through the index
+  index_insert(k, s);        // and it can now be found under its parent
+  unlock_inode(s, previous);
+  return FS_OK;
+}
+
+// remove a directory
+int removedirectory (char * directory, filesystem * s) {
+  char *path[MAX_DEPTH];                              
+  int i = split_path(directory, path);
+  if (i == -1) {
+    return FS_EINVAL;
+  }
+
+  char * name = path[i-1];
+  TRACE(TRACE_DEBUG, "this is the directory name: %s \n", trace_name(name));
+
+  int failed;
+  uint32_t found;
+  int d_inode = walk_path(path, i, s, &failed, &found);       // storing the inode number of the directory to be deleted
+  if (d_inode == -1 || (*s).inodes[d_inode].dir != 1){
+    printf("The directory does not exist.\n");        // error checking in case the directory does not exist
+    return FS_ENOENT;
+  }
+  TRACE(TRACE_DEBUG, "this is the directory inode: %d \n", d_inode);
+
+  int parent = (*s).inodes[d_inode].parent;          // the directory which holds this one
+  if (parent == -1) {
+    printf("The directory does not exist.\n");        // the root, or its parent is being removed
+    return FS_ENOENT;
+  }
+  lock_pair(s, parent, d_inode);
+  if (!inode_current(s, d_inode, found) || (*s).inodes[d_inode].parent != parent) {
+    unlock_pair(s, parent, d_inode);
+    printf("The directory does not exist.\n");        // removed by another thread since the walk
+    return FS_ENOENT;
+  }
+  if (dir_private(s, parent) == -1) {
+    unlock_pair(s, parent, d_inode);
+    printf("No Space left to change the directory.\n");      // it is shared with a snapshot and has to be copied
+    return FS_ENOSPC;
+  }
+  dir_remove(s, parent, d_inode);                    // taking the directory's entry out of its parent
+  TRACE(TRACE_INFO, "name of parent inode: %.8s, entries left: %d \n", trace_name((*s).inodes[parent].name), (*s).inodes[parent].entries);
+  index_remove(d_inode, s);      // unlinking the directory from the path index before its name is cleared
+  pthread_rwlock_wrlock(&(*s).tree_lock);           // writes below it stop at it from now on, or are already counted
+  propagate_locked(d_inode, -__atomic_load_n(&(*s).inodes[d_inode].size, __ATOMIC_RELAXED),
+                   -1 - __atomic_load_n(&(*s).inodes[d_inode].below, __ATOMIC_RELAXED), s);     // one update of the ancestors for the whole subtree
+  __atomic_store_n(&(*s).inodes[d_inode].parent, -1, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&(*s).tree_lock);
+  unlock_pair(s, parent, d_inode);
+
+  // tearing down the subtree, one directory at a time
+  // every entry is detached from its directory before the directory goes, so nothing is left pointing at a freed inode
+  // and only the lock of the directory being emptied is held
+  int *stack = NULL;                                 // directories still to be emptied
+  int top = 0, cap = 0;
+  release_batch batch = {0};
+  my_batch = &batch;
+  int d = d_inode;
+  uint32_t dirs = 0, files = 0;
+  while (d != -1) {
+    lock_inode(s, d);
+    int64_t pos = 0;
+    dirent *e;
+    while ((e = dir_next(s, d, &pos)) != NULL) {
+      int c = e->inode;
+      index_remove(c, s);                            // the child can no longer be reached by its path
+      if ((*s).inodes[c].dir == 1) {
+        (*s).inodes[c].parent = -1;                  // emptied once its parent is gone
+        inode_dirty(s, c);
+        if (top == cap) {
+          cap = cap ? cap * 2 : 64;
+          stack = realloc(stack, cap * sizeof(int));
+          if (stack == NULL) {
+            perror("realloc");
+            exit(1);
+          }
+        }
+        stack[top++] = c;
+      } else {
+        free_file_blocks(s, c);
+        free_inode(c, s);
+        files++;
+      }
+    }
+    free_file_blocks(s, d);                          // the blocks that held its entries
+    free_inode(d, s);
+    unlock_inode(s, d);
+    dirs++;
+    d = top > 0 ? stack[--top] : -1;
+  }
+  my_batch = NULL;
+  batch_release(s, &batch);
+  free(batch.blocks);
+  free(stack);
+  TRACE(TRACE_INFO, "removed %d directories and %d files \n", dirs, files);
+  return FS_OK;
+}
+
+// snapshots
+// SN copies the inode table into fresh blocks and takes a reference to every block the inodes point at, so the
+// disk and the snapshot share all of their blocks and the writes that follow copy a block before changing it
+// taking one costs a pass over the inode table, whatever the files hold, and SR only changes the inodes, the
+// references and the blocks of the inode table that differ from the snapshot, leaving every other block as it is
+
+// inodes held by each block of a snapshot's copy of the inode table
+uint32_t snapshot_per_block (filesystem * s) {
+  return (*s).sb->block_size / sizeof(inode);
+}
+
+// the runs of blocks holding the copy of snapshot header h, a start and a count for each
+uint32_t * snapshot_runs (snapshot_header * h) {
+  return (uint32_t *)(h + 1);
+}
+
+// the entry of the snapshot called name, -1 if there is none, an empty name finds a free entry
+int snapshot_find (filesystem * s, const char * name) {
+  for (int n = 0; n < MAX_SNAPSHOTS; n++) {
+    snapshot *snap = &(*s).sb->snapshots[n];
+    if ((name[0] == '\0') == (snap->header == 0) && strncmp(snap->name, name, FILENAME_MAXLEN) == 0) {
+      return n;
+    }
+  }
+  return -1;
+}
+
+// releasing the blocks of snapshot header h and of the copy it lists
+void snapshot_release (filesystem * s, int header) {
+  snapshot_header *h = (snapshot_header *)block_at(s, header);
+  uint32_t *run = snapshot_runs(h);
+  for (uint32_t r = 0; r < h->runs; r++) {
+    for (uint32_t i = 0; i < run[2 * r + 1]; i++) {
+      free_block(s, run[2 * r] + i);
+    }
+  }
+  free_block(s, header);
+}
+
+// taking a snapshot of the whole disk
+int snapshot_create (char * name, filesystem * s) {
+  if (strlen(name) > FILENAME_MAXLEN) {
+    printf("Name of the snapshot cannot exceed 8 characters.\n");
+    return FS_ENAMETOOLONG;
+  }
+  if (snapshot_find(s, name) != -1) {
+    printf("The snapshot already exists.\n");
+    return FS_EEXIST;
+  }
+  int n = snapshot_find(s, "");
+  if (n == -1) {
+    printf("No Space for another snapshot.\n");
+    return FS_ENOSPC;
+  }
+  uint32_t per = snapshot_per_block(s), total = (*s).sb->total_inodes;
+  uint32_t table_blocks = (total + per - 1) / per;
+  uint32_t most = ((*s).sb->block_size - sizeof(snapshot_header)) / (2 * sizeof(uint32_t));    // runs the header can list
+  int header = table_blocks < free_block_count(s) ? alloc_block(s) : -1;
+  if (header == -1) {
+    printf("No Space for the snapshot.\n");
+    return FS_ENOSPC;
+  }
+  snapshot_header *h = (snapshot_header *)block_at(s, header);      // a fresh block, so it starts out zeroed
+  uint32_t *run = snapshot_runs(h);
+  uint32_t want = table_blocks;
+  for (uint32_t done = 0; done < table_blocks; ) {
+    want = want < table_blocks - done ? want : table_blocks - done;
+    int b = h->runs < most ? alloc_run(s, want) : -1;
+    if (b == -1 && want > 1 && h->runs < most) {
+      want /= 2;                                   // no run that long is free, trying a shorter one
+      continue;
+    }
+    if (b == -1) {
+      snapshot_release(s, header);                 // taken by other threads, or too scattered for the header
+      printf("No Space for the snapshot.\n");
+      return FS_ENOSPC;
+    }
+    run[2 * h->runs] = b;
+    run[2 * h->runs + 1] = want;
+    h->runs++;
+    done += want;
+  }
+
+  uint32_t k = 0;
+  for (uint32_t r = 0; r < h->runs; r++) {
+    for (uint32_t i = 0; i < run[2 * r + 1]; i++) {
+      uint32_t count = total - k < per ? total - k : per;
+      char *copy = block_at(s, run[2 * r] + i);
+      memcpy(copy, &(*s).inodes[k], count * sizeof(inode));
+      mark_dirty(s, copy, (*s).sb->block_size);
+      k += count;
+    }
+  }
+  for (k = 0; k < total; k++) {
+    if ((*s).inodes[k].used) {
+      share_tree(s, &(*s).inodes[k]);              // the snapshot holds its own reference to what the inode points at
+    }
+  }
+  h->taken = time(NULL);
+  h->free_inodes = free_inode_count(s);
+  h->free_blocks = free_block_count(s);
+  h->table_blocks = table_blocks;
+  mark_dirty(s, h, (*s).sb->block_size);
+  snapshot *snap = &(*s).sb->snapshots[n];
+  memset(snap->name, 0, FILENAME_MAXLEN);
+  memcpy(snap->name, name, strlen(name));
+  snap->header = header;
+  mark_dirty(s, snap, sizeof(snapshot));
+  TRACE(TRACE_INFO, "snapshot %s of %d inodes in %d runs of blocks \n", trace_name(name), total, h->runs);
+  return FS_OK;
+}
+
+// listing the snapshots, in the order of the table
+int snapshot_list (filesystem * s) {
+  for (int n = 0; n < MAX_SNAPSHOTS; n++) {
+    snapshot *snap = &(*s).sb->snapshots[n];
+    if (snap->header == 0) {
+      continue;
+    }
+    snapshot_header *h = (snapshot_header *)block_at(s, snap->header);
+    time_t taken = h->taken;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&taken));
+    printf("Snapshot: %.8s Taken: %s Files and directories: %u \n", snap->name, when, (*s).sb->total_inodes - h->free_inodes);
+  }
+  return FS_OK;
+}
+
+// checking if two inodes point at the same blocks, so putting one in place of the other keeps every reference
+int same_blocks (inode * a, inode * b) {
+  if (!a->used || !b->used) {
+    return !a->used && !b->used;
+  }
+  return memcmp(a->blockptrs, b->blockptrs, sizeof(a->blockptrs)) == 0 && a->indirect == b->indirect &&
+         a->dindirect == b->dindirect;
+}
+
+// putting the disk back the way it was when the snapshot was taken, the snapshot is kept
+int snapshot_rollback (char * name, filesystem * s) {
+  int n = snapshot_find(s, name);
+  if (name[0] == '\0' || n == -1) {
+    printf("The snapshot does not exist.\n");
+    return FS_ENOENT;
+  }
+  snapshot_header *h = (snapshot_header *)block_at(s, (*s).sb->snapshots[n].header);
+  uint32_t *run = snapshot_runs(h);
+  uint32_t per = snapshot_per_block(s), total = (*s).sb->total_inodes;
+  release_batch batch = {0};
+  my_batch = &batch;
+  uint32_t k = 0, changed = 0;
+  for (uint32_t r = 0; r < h->runs; r++) {
+    for (uint32_t i = 0; i < run[2 * r + 1]; i++) {
+      uint32_t count = total - k < per ? total - k : per;
+      inode *copy = (inode *)block_at(s, run[2 * r] + i);
+      if (memcmp(copy, &(*s).inodes[k], count * sizeof(inode)) != 0) {
+        for (uint32_t j = 0; j < count; j++) {
+          inode *now = &(*s).inodes[k + j], *then = &copy[j];
+          if (!same_blocks(now, then)) {
+            if (then->used) {
+              share_tree(s, then);                 // taken before the disk's references go, the snapshot still holds
+            }                                      // everything below, so nothing it reaches can be freed
+            if (now->used) {
+              free_tree(s, now);
+            }
+            changed++;
+          }
+        }
+        memcpy(&(*s).inodes[k], copy, count * sizeof(inode));
+        mark_dirty(s, &(*s).inodes[k], count * sizeof(inode));
+      }
+      k += count;
+    }
+  }
+  my_batch = NULL;
+  batch_release(s, &batch);
+  free(batch.blocks);
+  __atomic_store_n(&(*s).sb->free_inodes, h->free_inodes, __ATOMIC_RELEASE);
+  (*s).inode_hint = 0;
+  index_reset(s);                                  // filled again from the directories as they are used
+  TRACE(TRACE_INFO, "rolled back to %s, %d inodes point at other blocks \n", trace_name(name), changed);
+  return FS_OK;
+}
+
+// deleting a snapshot, the blocks that only it reached are freed
+int snapshot_delete (char * name, filesystem * s) {
+  int n = snapshot_find(s, name);
+  if (name[0] == '\0' || n == -1) {
+    printf("The snapshot does not exist.\n");
+    return FS_ENOENT;
+  }
+  snapshot *snap = &(*s).sb->snapshots[n];
+  snapshot_header *h = (snapshot_header *)block_at(s, snap->header);
+  uint32_t *run = snapshot_runs(h);
+  uint32_t per = snapshot_per_block(s), total = (*s).sb->total_inodes;
+  release_batch batch = {0};
+  my_batch = &batch;
+  uint32_t k = 0;
+  for (uint32_t r = 0; r < h->runs; r++) {
+    for (uint32_t i = 0; i < run[2 * r + 1]; i++) {
+      uint32_t count = total - k < per ? total - k : per;
+      inode *copy = (inode *)block_at(s, run[2 * r] + i);
+      for (uint32_t j = 0; j < count; j++) {
+        if (copy[j].used) {
+          free_tree(s, &copy[j]);
+        }
+      }
+      k += count;
+    }
+  }
+  snapshot_release(s, snap->header);
+  my_batch = NULL;
+  batch_release(s, &batch);
+  free(batch.blocks);
+  memset(snap, 0, sizeof(snapshot));
+  mark_dirty(s, snap, sizeof(snapshot));
+  TRACE(TRACE_INFO, "deleted the snapshot %s \n", trace_name(name));
+  return FS_OK;
+}
+
+// reading a size such as 4096, 64K, 512M or 2G, returns -1 if text is not one
+int64_t parse_size (const char * text) {
+  char *end;
+  errno = 0;
+  uint64_t value = strtoull(text, &end, 10);
+  uint64_t scale = 1;
+  switch (*end) {
+    case 'G': case 'g': scale *= 1024;        // multiplying by 1024 once per step down to K
+      __attribute__((fallthrough));
+    case 'M': case 'm': scale *= 1024;
+      __attribute__((fallthrough));
+    case 'K': case 'k': scale *= 1024;
+      end++;
+  }
+  if (end == text || *text == '-' || *end != '\0' || errno == ERANGE || value > INT64_MAX / scale) {
+    return -1;
+  }
+  return value * scale;
+}
+
+// the value of option opt, which has to be a size of at most max, the program stops if it is not
+uint64_t size_option (int opt, const char * text, uint64_t max) {
+  int64_t value = parse_size(text);
+  if (value < 0 || (uint64_t)value > max) {
+    fprintf(stderr, "Invalid value %s for -%c.\n", text, opt);
+    exit(1);
+  }
+  return value;
+}
+
+// batch engine
+// the commands are read through one large buffer and every line is split in place, nothing is copied on the way
+// each command returns a status instead of stopping the program, so a long trace replays in one run
+
+// the commands as the batch engine calls them, argv holds the arguments after the command name
+int run_cr (char ** argv, filesystem * s) {
+  if (check_space(s) == -1) {                  // if there is no space to create a file
+    printf("No Space to create a file.\n");
+    return FS_ENOSPC;
+  }
+  return createfile(argv[0], argv[1], s);
+}
+
+int run_cp (char ** argv, filesystem * s) {
+  if (check_space(s) == -1) {
+    printf("No Space to copy a file.\n");      // if there is no space to copy a file
+    return FS_ENOSPC;
+  }
+  return copyfile(argv[0], argv[1], s);
+}
+
+int run_dl (char ** argv, filesystem * s) {
+  return removefile(argv[0], s);
+}
+
+int run_mv (char ** argv, filesystem * s) {
+  return movefile(argv[0], argv[1], s);
+}
+
+int run_ll (char ** argv, filesystem * s) {
+  if (argv[0] == NULL) {
+    return listfile(s);                        // every inode in use, in table order
+  }
+  return listtree(argv[0], argv[1], argv[1] == NULL ? NULL : argv[2], s);
+}
+
+int run_cd (char ** argv, filesystem * s) {
+  if (check_space(s) == -1) {
+    printf("No Space to create directory.\n");     // if there is no space to create a directory
+    return FS_ENOSPC;
+  }
+  return createdirectory(argv[0], s);
+}
+
+int run_dd (char ** argv, filesystem * s) {
+  return removedirectory(argv[0], s);
+}
+
+int run_wr (char ** argv, filesystem * s) {
+  return writefile(argv[0], argv[1], argv[2], s);
+}
+
+int run_rd (char ** argv, filesystem * s) {
+  return readfile(argv[0], argv[1], argv[2], s);
+}
+
+int run_ap (char ** argv, filesystem * s) {
+  return appendfile(argv[0], argv[1], s);
+}
+
+int run_sy (char ** argv, filesystem * s) {
+  (void)argv;                                      // SY takes no arguments
+  return sync_disk(s) == -1 ? FS_EIO : FS_OK;      // writing the changes so far back to the image
+}
+
+int run_sn (char ** argv, filesystem * s) {
+  return snapshot_create(argv[0], s);
+}
+
+int run_sl (char ** argv, filesystem * s) {
+  (void)argv;                                      // SL takes no arguments
+  return snapshot_list(s);
+}
+
+int run_sr (char ** argv, filesystem * s) {
+  return snapshot_rollback(argv[0], s);
+}
+
+int run_sd (char ** argv, filesystem * s) {
+  return snapshot_delete(argv[0], s);
+}
+
+int run_st (char ** argv, filesystem * s);
+
+// a command of the input language
+typedef struct command {
+  const char * name;
+  int args;                                    // number of arguments it needs
+  int most;                                    // number of arguments it can take
+  int (*run) (char ** argv, filesystem * s);
+} command;
+
+command commands[] = {
+  {"CR", 2, 2, run_cr},     // create file: CR <path> <size>
+  {"CP", 2, 2, run_cp},     // copy file: CP <source> <destination>
+  {"DL", 1, 1, run_dl},     // delete file: DL <path>
+  {"MV", 2, 2, run_mv},     // move or rename a file or directory: MV <source> <destination>
+  {"LL", 0, 3, run_ll},     // list files and directories: LL [<path> [<depth> [<cursor>]]]
+  {"CD", 1, 1, run_cd},     // create directory: CD <path>
+  {"DD", 1, 1, run_dd},     // delete directory: DD <path>
+  {"WR", 3, 3, run_wr},     // write to a file: WR <path> <offset> <data>
+  {"RD", 3, 3, run_rd},     // read from a file: RD <path> <offset> <length>
+  {"AP", 2, 2, run_ap},     // append to a file: AP <path> <data>
+  {"SY", 0, 0, run_sy},     // write the dirty blocks back to the image
+  {"ST", 0, 0, run_st},     // print the statistics as JSON
+  {"SN", 1, 1, run_sn},     // take a snapshot: SN <name>
+  {"SL", 0, 0, run_sl},     // list the snapshots
+  {"SR", 1, 1, run_sr},     // roll back to a snapshot: SR <name>
+  {"SD", 1, 1, run_sd},     // delete a snapshot: SD <name>
+};
+_Static_assert(sizeof(commands) / sizeof(commands[0]) <= MAX_COMMANDS, "the statistics keep MAX_COMMANDS commands");
+
+// nanoseconds on the monotonic clock
+uint64_t now_ns () {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// the histogram bucket holding a latency of ns nanoseconds
+int hist_bucket (uint64_t ns) {
+  if (ns < HIST_SUB) {
+    return ns;                                 // the smallest values get a bucket each
+  }
+  int e = 63 - __builtin_clzll(ns);            // ns lies between 2^e and 2^(e+1)
+  return (e - HIST_SHIFT + 1) * HIST_SUB + (int)((ns >> (e - HIST_SHIFT)) & (HIST_SUB - 1));
+}
+
+// the largest latency that falls in bucket b
+uint64_t hist_upper (int b) {
+  if (b < HIST_SUB) {
+    return b;
+  }
+  int e = b / HIST_SUB + HIST_SHIFT - 1;
+  return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) << (e - HIST_SHIFT)) - 1;
+}
+
+// counting one run of command c
+void stats_record (int c, uint64_t ns, int status) {
+  my_stats->hist[c][hist_bucket(ns)]++;
+  my_stats->total_ns[c] += ns;
+  my_stats->errors[c] += status != FS_OK;
+}
+
+// the latency below which a fraction q of the count runs in histogram h fell
+uint64_t hist_quantile (uint64_t * h, uint64_t count, double q) {
+  uint64_t want = (uint64_t)(q * count + 0.5), seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += h[b];
+    if (seen >= want && seen > 0) {
+      return hist_upper(b);
+    }
+  }
+  return 0;
+}
+
+// printing the statistics of every slot added together as one JSON object
+void stats_dump (FILE * out) {
+  static stats sum;
+  memset(&sum, 0, sizeof(sum));
+  for (int t = 0; t < STAT_SLOTS; t++) {
+    uint64_t *from = (uint64_t *)&stat_slots[t], *to = (uint64_t *)&sum;     // every field is a uint64_t
+    for (size_t i = 0; i < sizeof(stats) / sizeof(uint64_t); i++) {
+      to[i] += from[i];
+    }
+  }
+  fprintf(out, "{\"commands\": {");
+  int first = 1;
+  for (size_t c = 0; c < sizeof(commands) / sizeof(commands[0]); c++) {
+    uint64_t count = 0;
+    int last = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+      count += sum.hist[c][b];
+      last = sum.hist[c][b] ? b : last;
+    }
+    if (count == 0) {
+      continue;
+    }
+    fprintf(out, "%s\"%s\": {\"count\": %llu, \"errors\": %llu, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f, \"histogram_ns\": [",
+            first ? "" : ", ", commands[c].name, (unsigned long long)count, (unsigned long long)sum.errors[c],
+            sum.total_ns[c] / 1e3 / count, hist_quantile(sum.hist[c], count, 0.5) / 1e3, hist_quantile(sum.hist[c], count, 0.99) / 1e3,
+            hist_quantile(sum.hist[c], count, 0.999) / 1e3, hist_upper(last) / 1e3);
+    int first_bucket = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+      if (sum.hist[c][b]) {                    // [largest latency in the bucket, runs in it] for every bucket in use
+        fprintf(out, "%s[%llu, %llu]", first_bucket ? "" : ", ", (unsigned long long)hist_upper(b), (unsigned long long)sum.hist[c][b]);
+        first_bucket = 0;
+      }
+    }
+    fprintf(out, "]}");
+    first = 0;
+  }
+  fprintf(out, "}, \"counters\": {\"inodes_scanned\": %llu, \"blocks_scanned\": %llu, \"ancestors_walked\": %llu, "
+               "\"bytes_zeroed\": %llu, \"bytes_written\": %llu, \"bytes_read\": %llu, \"bytes_synced\": %llu, \"commits\": %llu, \"bytes_journaled\": %llu, "
+               "\"cache_hits\": %llu, \"cache_misses\": %llu, \"cache_hit_rate\": %.4f, \"cache_readahead\": %llu, \"cache_evictions\": %llu, "
+               "\"bytes_inline\": %llu, \"dedup_hits\": %llu, \"dedup_misses\": %llu, \"dedup_evictions\": %llu}}\n",
+          (unsigned long long)sum.inodes_scanned, (unsigned long long)sum.blocks_scanned, (unsigned long long)sum.ancestors_walked,
+          (unsigned long long)sum.bytes_zeroed, (unsigned long long)sum.bytes_written, (unsigned long long)sum.bytes_read,
+          (unsigned long long)sum.bytes_synced,
+          (unsigned long long)sum.commits, (unsigned long long)sum.bytes_journaled, (unsigned long long)sum.cache_hits,
+          (unsigned long long)sum.cache_misses, sum.cache_hits + sum.cache_misses ? (double)sum.cache_hits / (sum.cache_hits + sum.cache_misses) : 0.0,
+          (unsigned long long)sum.cache_readahead, (unsigned long long)sum.cache_evictions, (unsigned long long)sum.bytes_inline,
+          (unsigned long long)sum.dedup_hits, (unsigned long long)sum.dedup_misses, (unsigned long long)sum.dedup_evictions);
+}
+
+int run_st (char ** argv, filesystem * s) {
+  (void)argv;                                      // ST takes no arguments and reads the statistics, not the file system
+  (void)s;
+  stats_dump(stdout);
+  return FS_OK;
+}
+
+// running one line of input, which is split in place, returns the command's status
+int run_line (char * line, filesystem * s) {
+  char *word[2 + MAX_ARGS];                    // the command name and its arguments, then NULL
+  int n = 0;
+  char *p = line + strspn(line, " \t\r");
+  if (*p == '@') {
+    p += strcspn(p, " \t\r");                  // the thread a parallel replay runs it on, nothing to the command
+  }
+  while (*p != '\0' && n < 1 + MAX_ARGS) {
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+      p++;                                     // skipping the blanks before a word
+    }
+    if (*p == '\0') {
+      break;
+    }
+    word[n++] = p;
+    while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r') {
+      p++;
+    }
+    if (*p != '\0') {
+      *p++ = '\0';                             // ending the word where it is
+    }
+  }
+  while (*p == ' ' || *p == '\t' || *p == '\r') {
+    p++;
+  }
+  int extra = *p != '\0';                      // words beyond any command's arguments
+  if (n == 0) {
+    return FS_OK;                              // blank lines are skipped
+  }
+  word[n] = NULL;                              // so a command can tell which optional arguments it was given
+  for (size_t c = 0; c < sizeof(commands) / sizeof(commands[0]); c++) {
+    if (strcmp(word[0], commands[c].name) == 0) {
+      if (n - 1 < commands[c].args || n - 1 > commands[c].most || extra) {
+        if (commands[c].args == commands[c].most) {
+          printf("%s takes %d arguments.\n", commands[c].name, commands[c].args);
+        } else {
+          printf("%s takes %d to %d arguments.\n", commands[c].name, commands[c].args, commands[c].most);
+        }
+        return FS_EINVAL;                      // a word left over would be dropped, WR and AP data cannot hold blanks
+      }
+      uint64_t start = now_ns();
+      txn_begin(s);
+      int status = commands[c].run(word + 1, s);
+      uint64_t took = now_ns() - start;        // a group commit is not counted in the command's latency
+      if (txn_end(s) == -1 && status == FS_OK) {
+        status = FS_EIO;                       // its changes could not be committed
+      }
+      stats_record(c, took, status);
+      return status;
+    }
+  }
+  printf("Unknown command %s.\n", word[0]);
+  return FS_EINVAL;
+}
+
+// running every command read from fd, returns the number of commands that failed or -1 if the input could not be read
+int64_t run_batch (int fd, filesystem * s) {
+  char *buf = malloc(BATCH_BUFFER + 1);        // one byte more, so the last line can always be terminated
+  if (buf == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  uint64_t lineno = 0, ran = 0, failed = 0;
+  size_t len = 0;                              // bytes in the buffer not yet run
+  int skipping = 0;                            // dropping the rest of a line longer than the buffer
+  int done = 0;
+  while (!done) {
+    ssize_t got = read(fd, buf + len, BATCH_BUFFER - len);
+    if (got == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Unable to read the commands");
+      free(buf);
+      return -1;
+    }
+    if (got == 0) {
+      done = 1;                                // the end of the input ends its last line too
+      if (len > 0 && !skipping) {
+        buf[len++] = '\n';
+      }
+    }
+    len += got;
+    char *line = buf;
+    char *end = buf + len;
+    char *nl;
+    while ((nl = memchr(line, '\n', end - line)) != NULL) {
+      *nl = '\0';
+      lineno++;
+      if (skipping) {
+        skipping = 0;                          // the end of the overlong line
+      } else {
+        ran++;
+        int status = run_line(line, s);
+        if (status != FS_OK) {
+          failed++;
+          printf("line %llu failed with status %d \n", (unsigned long long)lineno, status);
+        }
+      }
+      line = nl + 1;
+    }
+    len = end - line;
+    if (len == BATCH_BUFFER) {                 // a whole buffer without a newline
+      if (!skipping) {
+        ran++;
+        failed++;
+        printf("line %llu is longer than %d bytes \n", (unsigned long long)lineno + 1, BATCH_BUFFER);
+      }
+      skipping = 1;
+      len = 0;
+    } else if (skipping) {
+      len = 0;
+    } else {
+      memmove(buf, line, len);                 // keeping the partial line for the next read
+    }
+  }
+  free(buf);
+  printf("ran %llu lines, %llu failed \n", (unsigned long long)ran, (unsigned long long)failed);
+  return failed;
+}
+
+// parallel replay
+// the whole input is read first and every line goes to the worker owning the top level directory of its path, so the
+// commands on one subtree keep their order while different subtrees run at once
+// a line that spans two subtrees, or touches none of them, is a barrier: the workers finish the lines before it,
+// it runs alone on the main thread and then the workers carry on
+// the status of a failed line is printed as it fails, so the failures of different workers can come out of order
+
+// the shared state of a parallel replay
+typedef struct replay {
+  filesystem * s;
+  char ** lines;
+  pthread_barrier_t start;     // a round of lines is ready, or the replay is over
+  pthread_barrier_t done;      // every worker is through its lines of the round
+  int finished;
+} replay;
+
+// one replay thread and the line numbers it runs this round
+typedef struct worker {
+  pthread_t thread;
+  int id;
+  replay * r;
+  uint32_t * todo;
+  uint32_t count;
+  uint32_t cap;
+  uint64_t failed;
+} worker;
+
+// the worker owning the top level directory of path, which ends at a blank or the end of the line
+int path_owner (const char * path, int workers) {
+  char name[FILENAME_MAXLEN + 1] = {0};
+  while (*path == '/') {
+    path++;
+  }
+  for (int i = 0; i < FILENAME_MAXLEN && path[i] != '\0' && path[i] != '/' && path[i] != ' ' && path[i] != '\t' && path[i] != '\r'; i++) {
+    name[i] = path[i];
+  }
+  return name_hash(name, 0) % workers;
+}
+
+// the worker that runs line, -1 if it has to run alone
+int line_owner (const char * line, int workers) {
+  const char *word[1 + MAX_ARGS];
+  int n = 0;
+  const char *p = line + strspn(line, " \t\r");
+  if (*p == '@') {
+    return (int)(strtoul(p + 1, NULL, 10) % workers);     // placed by the input, whatever it touches
+  }
+  while (*p != '\0' && n < 1 + MAX_ARGS) {
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+    word[n++] = p;
+    while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r') {
+      p++;
+    }
+  }
+  if (n < 2) {
+    return n == 0 ? 0 : -1;                    // blank lines go anywhere, LL, SY, ST and SL see the whole disk
+  }
+  if (word[0][0] == 'S') {
+    return -1;                                 // and so do the snapshots
+  }
+  if (strncmp(word[0], "LL", 2) == 0 && strchr("/ \t\r", word[1][strspn(word[1], "/")]) != NULL) {
+    return -1;                                 // listing from the root sees every subtree
+  }
+  int owner = path_owner(word[1], workers);
+  if (n == 3 && (strncmp(word[0], "CP", 2) == 0 || strncmp(word[0], "MV", 2) == 0) && path_owner(word[2], workers) != owner) {
+    return -1;                                 // copying or moving between two subtrees
+  }
+  return owner;
+}
+
+// running the lines of each round on one thread with its own statistics slot
+void * replay_worker (void * arg) {
+  worker *w = arg;
+  my_slot = w->id + 1;
+  my_stats = &stat_slots[my_slot];
+  while (1) {
+    pthread_barrier_wait(&w->r->start);
+    if (w->r->finished) {
+      break;
+    }
+    for (uint32_t i = 0; i < w->count; i++) {
+      int status = run_line(w->r->lines[w->todo[i]], w->r->s);
+      if (status != FS_OK) {
+        w->failed++;
+        printf("line %u failed with status %d \n", w->todo[i] + 1, status);
+      }
+    }
+    pthread_barrier_wait(&w->r->done);
+  }
+  return NULL;
+}
+
+// running every command read from fd on the given number of threads, returns the number of commands that failed
+// or -1 if the input could not be read
+int64_t run_parallel (int fd, filesystem * s, int workers) {
+  size_t cap = BATCH_BUFFER, len = 0;
+  char *buf = malloc(cap + 1);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  while (1) {
+    if (len == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap + 1);
+      if (buf == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    ssize_t got = read(fd, buf + len, cap - len);
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got == -1) {
+      perror("Unable to read the commands");
+      free(buf);
+      return -1;
+    }
+    if (got == 0) {
+      break;
+    }
+    len += got;
+  }
+  if (len > 0 && buf[len - 1] != '\n') {
+    buf[len++] = '\n';                        // the end of the input ends its last line too
+  }
+
+  uint32_t nlines = 0;
+  for (char *p = buf; (p = memchr(p, '\n', buf + len - p)) != NULL; p++) {
+    nlines++;
+  }
+  replay r = {0};
+  r.s = s;
+  r.lines = malloc((nlines > 0 ? nlines : 1) * sizeof(char *));
+  worker *w = calloc(workers, sizeof(worker));
+  if (r.lines == NULL || w == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  char *line = buf;
+  for (uint32_t i = 0; i < nlines; i++) {
+    char *nl = memchr(line, '\n', buf + len - line);
+    *nl = '\0';
+    r.lines[i] = line;
+    line = nl + 1;
+  }
+
+  pthread_barrier_init(&r.start, NULL, workers + 1);
+  pthread_barrier_init(&r.done, NULL, workers + 1);
+  for (int t = 0; t < workers; t++) {
+    w[t].id = t;
+    w[t].r = &r;
+    if (pthread_create(&w[t].thread, NULL, replay_worker, &w[t]) != 0) {
+      printf("Unable to start the replay threads.\n");
+      exit(1);
+    }
+  }
+  uint64_t failed = 0;
+  uint32_t queued = 0;                           // lines handed out for the round
+  for (uint32_t i = 0; i <= nlines; i++) {
+    int owner = i < nlines ? line_owner(r.lines[i], workers) : -1;
+    if (owner != -1) {
+      worker *o = &w[owner];
+      if (o->count == o->cap) {
+        o->cap = o->cap ? o->cap * 2 : 1024;
+        o->todo = realloc(o->todo, o->cap * sizeof(uint32_t));
+        if (o->todo == NULL) {
+          perror("realloc");
+          exit(1);
+        }
+      }
+      o->todo[o->count++] = i;
+      queued++;
+      continue;
+    }
+    if (queued > 0) {
+      pthread_barrier_wait(&r.start);            // running the round so far
+      pthread_barrier_wait(&r.done);
+      for (int t = 0; t < workers; t++) {
+        w[t].count = 0;
+      }
+      queued = 0;
+    }
+    if (i < nlines) {
+      int status = run_line(r.lines[i], s);      // the barrier line itself
+      if (status != FS_OK) {
+        failed++;
+        printf("line %u failed with status %d \n", i + 1, status);
+      }
+    }
+  }
+  r.finished = 1;
+  pthread_barrier_wait(&r.start);
+  for (int t = 0; t < workers; t++) {
+    pthread_join(w[t].thread, NULL);
+    failed += w[t].failed;
+    free(w[t].todo);
+  }
+  pthread_barrier_destroy(&r.start);
+  pthread_barrier_destroy(&r.done);
+  free(w);
+  free(r.lines);
+  free(buf);
+  printf("ran %u lines on %d threads, %llu failed \n", nlines, workers, (unsigned long long)failed);
+  return failed;
+}
+
+// server
+// with -S the image stays mounted and the commands arrive over a Unix domain socket, one per line as in a batch
+// a client can pipeline as many requests as it likes, and every line gets one response, in order: a line holding
+// the status and the length of what the command printed, "<status> <length>\n", then that many bytes of output
+// while the server runs, stdout is a memory stream, so everything a command prints goes into its response
+
+// a client connection
+typedef struct connection {
+  int fd;
+  char * in;                   // request bytes read but not yet run
+  size_t in_len;
+  char * out;                  // responses not yet sent
+  size_t out_len;
+  size_t out_cap;
+} connection;
+
+volatile sig_atomic_t stop_server = 0;         // set by SIGINT and SIGTERM
+
+void handle_stop (int sig) {
+  (void)sig;                                   // SIGINT and SIGTERM stop the server alike
+  stop_server = 1;
+}
+
+// queueing the response for one request, its status and the len bytes it printed
+void queue_response (connection * c, int status, const char * output, size_t len) {
+  while (c->out_cap - c->out_len < len + 32) {
+    c->out_cap = c->out_cap ? c->out_cap * 2 : 4096;
+    c->out = realloc(c->out, c->out_cap);
+    if (c->out == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  c->out_len += sprintf(c->out + c->out_len, "%d %zu\n", status, len);
+  memcpy(c->out + c->out_len, output, len);
+  c->out_len += len;
+}
+
+// sending as many queued responses as the socket takes, returns -1 if the client has gone
+int flush_responses (connection * c) {
+  size_t sent = 0;
+  while (sent < c->out_len) {
+    ssize_t n = write(c->fd, c->out + sent, c->out_len - sent);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;                                 // the rest goes out when the socket drains
+      }
+      return -1;
+    }
+    sent += n;
+  }
+  memmove(c->out, c->out + sent, c->out_len - sent);
+  c->out_len -= sent;
+  return 0;
+}
+
+// reading what the client sent and running every complete line, returns -1 once the client is done
+// output is the memory stream stdout points at, and *printed its buffer
+int serve_requests (connection * c, filesystem * s, FILE * output, char ** printed) {
+  ssize_t got = read(c->fd, c->in + c->in_len, CLIENT_BUFFER - c->in_len);
+  if (got == -1) {
+    return (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+  if (got == 0) {
+    return -1;                                 // the client closed its end
+  }
+  c->in_len += got;
+  char *line = c->in;
+  char *end = c->in + c->in_len;
+  char *nl;
+  while ((nl = memchr(line, '\n', end - line)) != NULL) {
+    *nl = '\0';
+    int status = run_line(line, s);
+    fflush(output);
+    queue_response(c, status, *printed, (size_t)ftello(output));
+    fseeko(output, 0, SEEK_SET);               // the next command prints over it
+    line = nl + 1;
+  }
+  c->in_len = end - line;
+  if (c->in_len == CLIENT_BUFFER) {
+    return -1;                                 // a line longer than the buffer, dropping the client
+  }
+  memmove(c->in, line, c->in_len);             // keeping the partial line for the next read
+  return 0;
+}
+
+// releasing connection c
+void close_connection (connection * c) {
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  c->fd = -1;
+}
+
+// serving clients on the socket at path until SIGINT or SIGTERM, returns -1 if the socket could not be set up
+int serve (const char * path, filesystem * s) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("The socket path is too long.\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listener == -1) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);                                // a socket left behind by an earlier run
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, MAX_CLIENTS) == -1) {
+    perror("Unable to listen on the socket");
+    close(listener);
+    return -1;
+  }
+
+  struct sigaction sa = {0};
+  sa.sa_handler = handle_stop;                 // no SA_RESTART, so poll returns when asked to stop
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);                    // a client that hangs up shows as a failed write instead
+  printf("serving on %s \n", path);
+  fflush(stdout);
+  char *printed = NULL;
+  size_t printed_len;
+  FILE *output = open_memstream(&printed, &printed_len);
+  if (output == NULL) {
+    perror("open_memstream");
+    exit(1);
+  }
+  FILE *console = stdout;
+  stdout = output;                             // what the commands print goes to the clients
+
+  connection clients[MAX_CLIENTS];
+  struct pollfd fds[MAX_CLIENTS + 1];
+  int owner[MAX_CLIENTS + 1];                  // the client behind each polled descriptor
+  for (int c = 0; c < MAX_CLIENTS; c++) {
+    clients[c].fd = -1;
+  }
+  while (!stop_server) {
+    int n = 0;
+    fds[n].fd = listener;
+    fds[n++].events = POLLIN;
+    for (int c = 0; c < MAX_CLIENTS; c++) {
+      if (clients[c].fd != -1) {
+        fds[n].fd = clients[c].fd;
+        fds[n].events = (clients[c].out_len < CLIENT_BUFFER ? POLLIN : 0) |      // holding back a client that does not read its responses
+                        (clients[c].out_len > 0 ? POLLOUT : 0);
+        owner[n++] = c;
+      }
+    }
+    if (poll(fds, n, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listener, NULL, NULL);
+      int c = 0;
+      while (c < MAX_CLIENTS && clients[c].fd != -1) {
+        c++;
+      }
+      if (fd != -1 && c == MAX_CLIENTS) {
+        close(fd);                             // no room for another client
+      } else if (fd != -1) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        clients[c] = (connection){fd, malloc(CLIENT_BUFFER), 0, NULL, 0, 0};
+        if (clients[c].in == NULL) {
+          perror("malloc");
+          exit(1);
+        }
+      }
+    }
+    for (int i = 1; i < n; i++) {
+      connection *c = &clients[owner[i]];
+      int done = 0;
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        done = serve_requests(c, s, output, &printed) == -1;
+      }
+      if (done && c->out_len > 0) {
+        fcntl(c->fd, F_SETFL, 0);              // the client stopped sending, answering what is left before closing
+      }
+      if (flush_responses(c) == -1 || done) {
+        close_connection(c);
+      }
+    }
+  }
+
+  for (int c = 0; c < MAX_CLIENTS; c++) {
+    if (clients[c].fd != -1) {
+      flush_responses(&clients[c]);
+      close_connection(&clients[c]);
+    }
+  }
+  close(listener);
+  unlink(path);
+  stdout = console;
+  fclose(output);
+  free(printed);
+  printf("server stopped \n");
+  return 0;
+}
+
+// consistency check
+// -k checks an image offline and -K repairs what it finds, nothing else runs while it does
+// the passes over the inode table and the block space are split into chunks that the threads claim as they go:
+// the inodes and their block trees are checked first, then the entries of every directory, and the parent pointers
+// are followed once from every inode to find what the root reaches, with each inode's depth
+// the files that are reached, the snapshots and the dedup table then count the references to each block, and the block space is
+// compared with them
+// a block only goes back to the free space once nothing reaches it, so a repair never frees a block still in use
+
+// what the checker knows about each inode and each block, and the problems found so far
+typedef struct check_state {
+  filesystem * s;
+  int repair;                  // fixing the problems, not just counting them
+  uint8_t * state;             // CHECK_ bits for each inode
+  uint32_t * links;            // entries naming each inode in the directory its parent pointer names
+  uint32_t * refs;             // references to each block from the files that are reached and the snapshots
+  snapshot_header * snapshot;  // the snapshot being checked
+  int damaged;                 // set once something in it is found wrong
+  int counting;                // counting the blocks it reaches, once it is known to be sound
+  uint64_t problems[CHECK_KINDS];
+  uint64_t free_blocks;        // blocks free once the block space has been checked
+  int started;                 // threads started, each takes the statistics slot after the last one
+  void (*pass) (struct check_state * c, uint64_t first, uint64_t end);      // the pass being run over items
+  uint64_t items;
+  uint64_t chunk;
+  uint64_t next;               // first item no thread has claimed yet
+} check_state;
+
+const char * check_messages[CHECK_KINDS] = {
+  "inodes in use with damaged fields or block pointers",
+  "free inodes that were not cleared",
+  "directory entries that are dangling, misplaced, repeated or missing",
+  "inodes in use that the root does not reach",
+  "blocks marked in use that no file reaches",
+  "blocks in use that are marked free",
+  "blocks with the wrong reference count",
+  "free blocks that do not read as zeroes",
+  "inodes with the wrong size, entry count or count of what is below them",
+  "free counts in the superblock that are wrong",
+  "incomplete transactions left in the journal",
+  "snapshots that are damaged",
+  "dedup table entries that are wrong",
+};
+
+// counting n problems of one kind
+void check_found (check_state * c, int kind, uint64_t n) {
+  __atomic_add_fetch(&c->problems[kind], n, __ATOMIC_RELAXED);
+}
+
+// claiming chunks of the current pass until there are none left
+void * check_worker (void * arg) {
+  check_state *c = arg;
+  uint64_t first;
+  while ((first = __atomic_fetch_add(&c->next, c->chunk, __ATOMIC_RELAXED)) < c->items) {
+    c->pass(c, first, first + c->chunk < c->items ? first + c->chunk : c->items);
+  }
+  return NULL;
+}
+
+// a checker thread, with its own statistics slot
+void * check_thread (void * arg) {
+  check_state *c = arg;
+  my_slot = __atomic_add_fetch(&c->started, 1, __ATOMIC_RELAXED);
+  my_stats = &stat_slots[my_slot];
+  return check_worker(c);
+}
+
+// running pass over items in chunks on threads threads, the main thread being one of them
+void check_parallel (check_state * c, int threads, void (*pass) (check_state * c, uint64_t first, uint64_t end),
+                     uint64_t items, uint64_t chunk) {
+  c->pass = pass;
+  c->items = items;
+  c->chunk = chunk;
+  c->next = 0;
+  c->started = 0;
+  pthread_t tid[MAX_WORKERS];
+  int n = 0;
+  while (n < threads - 1 && pthread_create(&tid[n], NULL, check_thread, c) == 0) {
+    n++;                                           // with fewer threads the ones there are claim more chunks
+  }
+  check_worker(c);
+  for (int t = 0; t < n; t++) {
+    pthread_join(tid[t], NULL);
+  }
+}
+
+// checking block pointer b, which should point at a data block if want is set and be -1 otherwise
+// returns -1 if it is wrong, 0 if it is rightly -1, 1 if it points at a block and 2 if counting found the block reached before
+int check_ref (check_state * c, int b, int want, int count) {
+  if (b == -1) {
+    return want ? -1 : 0;
+  }
+  if (!want || (uint32_t)b < c->s->sb->data_start || (uint32_t)b >= c->s->sb->total_blocks) {
+    return -1;
+  }
+  if (count && __atomic_add_fetch(&c->refs[b], 1, __ATOMIC_RELAXED) > 1) {
+    return 2;
+  }
+  return 1;
+}
+
+// checking index block b at the given level, which should map the next n blocks of a file, none if n <= 0
+// a shared index block is only walked by the first file counted through it, since its blocks are reached once through it
+int check_index (check_state * c, int b, int64_t n, int level, int count) {
+  int found = check_ref(c, b, n > 0, count);
+  if (found != 1) {
+    return found == -1 ? -1 : 0;
+  }
+  int *ptrs = (int *)block_at(c->s, b);
+  int64_t p = ptrs_per_block(c->s), span = level == 1 ? 1 : p;
+  for (int64_t i = 0; i < p; i++) {
+    int64_t left = n - i * span;                   // blocks of the file still to map from this pointer on
+    if ((level == 1 ? check_ref(c, ptrs[i], left > 0, count) : check_index(c, ptrs[i], left, 1, count)) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// checking that node maps exactly its first blocks blocks, all of them on the disk, counting them if count is set
+int check_tree (check_state * c, inode * node, int count) {
+  int64_t n = node->blocks, p = ptrs_per_block(c->s);
+  if (n < 0 || n > max_file_blocks(c->s)) {
+    return -1;
+  }
+  for (int j = 0; j < TOTAL_BLOCKPTRS; j++) {
+    if (check_ref(c, node->blockptrs[j], j < n, count) == -1) {
+      return -1;
+    }
+  }
+  if (check_index(c, node->indirect, n - TOTAL_BLOCKPTRS, 1, count) == -1) {
+    return -1;
+  }
+  return check_index(c, node->dindirect, n - TOTAL_BLOCKPTRS - p, 2, count);
+}
+
+// checking if a free inode looks the way free_inode and format leave it
+int check_cleared (inode * node) {
+  int clear = node->dir == 0 && node->parent == -1 && node->size == 0 && node->entries == 0 && node->below == 0 &&
+              node->blocks == 0 && node->indirect == -1 && node->dindirect == -1;
+  for (int j = 0; j < TOTAL_BLOCKPTRS; j++) {
+    clear = clear && node->blockptrs[j] == -1;
+  }
+  for (int j = 0; j < FILENAME_MAXLEN; j++) {
+    clear = clear && node->name[j] == '\0';
+  }
+  for (int j = 0; j < INLINE_MAX; j++) {
+    clear = clear && node->data[j] == '\0';
   }
-  memset(buffer, '\0', filesize);          // initializing the buffer
-  fwrite(buffer, filesize, 1, file);       // writing data to the file
-  fseek(file, 0, SEEK_SET);                // pointing towards the beginning of the file
+  return clear;
+}
 
-  // writing superblock 
-  if (fwrite(s_block, (128 * sizeof(char)) + (8 * sizeof(inode)), 1, file) != 1) {
-    perror("Unable to write data to the file.\n");      // in case of failure
-    fclose(file);
-    return 1;
+// leaving inode k free and cleared, without touching the blocks it points at, which are freed once nothing reaches them
+void check_clear (filesystem * s, int k) {
+  inode *node = &(*s).inodes[k];
+  memset(node, 0, sizeof(inode));
+  node->parent = -1;
+  for (int j = 0; j < TOTAL_BLOCKPTRS; j++) {
+    node->blockptrs[j] = -1;
+  }
+  node->indirect = -1;
+  node->dindirect = -1;
+  inode_dirty(s, k);
+}
+
+// first pass, the fields and block trees of the inodes in [first, end)
+void check_inodes (check_state * c, uint64_t first, uint64_t end) {
+  filesystem *s = c->s;
+  for (uint64_t k = first; k < end; k++) {
+    inode *node = &(*s).inodes[k];
+    if (node->used == 0) {
+      if (!check_cleared(node)) {
+        check_found(c, CHECK_STALE, 1);
+        if (c->repair) {
+          check_clear(s, k);
+        }
+      }
+      continue;
+    }
+    int bad = node->used != 1 || (node->dir != 0 && node->dir != 1) || node->size < 0 || node->entries < 0 ||
+              node->below < 0 || check_tree(c, node, 0) == -1;
+    if (k == 0) {
+      bad = bad || node->dir != 1 || node->parent != -1;
+    } else {
+      bad = bad || node->parent < 0 || (uint32_t)node->parent >= (*s).sb->total_inodes || node->name[0] == '\0';
+    }
+    if (bad) {
+      c->state[k] |= CHECK_BAD;
+      check_found(c, CHECK_INODE, 1);
+      TRACE(TRACE_INFO, "the inode %d is damaged \n", (int64_t)k);
+    }
+  }
+}
+
+// checking entry e of directory d, which has to name an undamaged inode whose parent is d by that inode's name
+int check_entry (check_state * c, int d, dirent * e) {
+  filesystem *s = c->s;
+  int k = e->inode;
+  if (k <= 0 || (uint32_t)k >= (*s).sb->total_inodes || e->namelen <= 0 || e->namelen > FILENAME_MAXLEN) {
+    return 0;
+  }
+  inode *node = &(*s).inodes[k];
+  return node->used == 1 && !(c->state[k] & CHECK_BAD) && node->parent == d &&
+         (int)strnlen(node->name, FILENAME_MAXLEN) == e->namelen && memcmp(e->name, node->name, e->namelen) == 0;
+}
+
+// an entry of a directory being checked or rewritten, sorted by name so that repeated names end up side by side
+typedef struct check_name {
+  char name[FILENAME_MAXLEN];
+  int inode;
+} check_name;
+
+int check_name_order (const void * a, const void * b) {
+  const check_name *x = a, *y = b;
+  int order = memcmp(x->name, y->name, FILENAME_MAXLEN);
+  return order != 0 ? order : (x->inode > y->inode) - (x->inode < y->inode);
+}
+
+// adding inode k to the growable list *names
+void check_name_add (check_name ** names, int64_t * count, int64_t * cap, int k, filesystem * s) {
+  if (*count == *cap) {
+    *cap = *cap ? *cap * 2 : 256;
+    *names = realloc(*names, *cap * sizeof(check_name));
+    if (*names == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  memcpy((*names)[*count].name, (*s).inodes[k].name, FILENAME_MAXLEN);
+  (*names)[(*count)++].inode = k;
+}
+
+// second pass, the entries of the directories in [first, end)
+// a directory whose entries are wrong, out of place, miscounted or share a name is marked to be rewritten
+void check_dirs (check_state * c, uint64_t first, uint64_t end) {
+  filesystem *s = c->s;
+  int hashed = (*s).sb->flags & FS_HASHED_DIRS;
+  int per = dirents_per_block(s);
+  check_name *names = NULL;
+  int64_t cap = 0;
+  for (uint64_t d = first; d < end; d++) {
+    inode *node = &(*s).inodes[d];
+    if (node->used != 1 || node->dir != 1 || (c->state[d] & CHECK_BAD)) {
+      continue;
+    }
+    if (hashed && (node->blocks & (node->blocks - 1)) != 0) {
+      c->state[d] |= CHECK_BAD;                    // a table that is not a power of two slots cannot be probed
+      check_found(c, CHECK_INODE, 1);
+      continue;
+    }
+    int rebuild = hashed ? 0 : node->blocks != (node->entries + per - 1) / per;
+    int64_t found = 0, count = 0;
+    for (int64_t i = 0; i < dir_capacity(s, d); i++) {
+      dirent *e = dir_slot(s, d, i);
+      if (e->namelen == 0) {
+        rebuild |= !hashed && i < node->entries;   // a hole in the array
+        continue;
+      }
+      found++;
+      if (!check_entry(c, d, e)) {
+        check_found(c, CHECK_ENTRY, 1);
+        TRACE(TRACE_INFO, "the directory %d has a bad entry for %d \n", (int64_t)d, e->inode);
+        rebuild = 1;
+        continue;
+      }
+      __atomic_add_fetch(&c->links[e->inode], 1, __ATOMIC_RELAXED);
+      rebuild |= hashed ? dir_find(s, d, (*s).inodes[e->inode].name) != i : i >= node->entries;
+      check_name_add(&names, &count, &cap, e->inode, s);
+    }
+    qsort(names, count, sizeof(check_name), check_name_order);
+    for (int64_t i = 1; i < count; i++) {
+      if (memcmp(names[i].name, names[i - 1].name, FILENAME_MAXLEN) == 0 && names[i].inode != names[i - 1].inode) {
+        check_found(c, CHECK_ENTRY, 1);            // two inodes under one name, a repeated inode is counted by its links
+        rebuild = 1;
+      }
+    }
+    if (hashed && found > 0 && found == dir_capacity(s, d)) {
+      c->state[d] |= CHECK_BAD;                    // no empty slot left, a lookup of a missing name would never stop
+      check_found(c, CHECK_INODE, 1);
+    } else if (rebuild || found != node->entries) {
+      c->state[d] |= CHECK_REBUILD;
+    }
+  }
+  free(names);
+}
+
+// following the parent pointers from every inode to find what the root reaches and how deep it is
+// an inode is reached when every inode above it is undamaged and a directory, whether or not the entries agree,
+// since a missing or wrong entry can be rewritten from the parent pointer
+// each inode is resolved once: the chain above it is marked until it meets a resolved inode, then resolved on the way back
+void check_reach (check_state * c, uint32_t * depth) {
+  filesystem *s = c->s;
+  for (uint32_t k = 0; k < (*s).sb->total_inodes; k++) {
+    c->state[k] &= ~(CHECK_DONE | CHECK_REACHED);
+  }
+  c->state[0] |= CHECK_DONE | CHECK_REACHED;
+  depth[0] = 0;
+  for (uint32_t k = 1; k < (*s).sb->total_inodes; k++) {
+    if ((*s).inodes[k].used == 0 || (c->state[k] & CHECK_DONE)) {
+      continue;
+    }
+    uint32_t chain = 0;
+    int j = k;
+    while (!(c->state[j] & (CHECK_DONE | CHECK_VISITING)) && (*s).inodes[j].used == 1 && !(c->state[j] & CHECK_BAD) &&
+           (*s).inodes[(*s).inodes[j].parent].dir == 1) {
+      c->state[j] |= CHECK_VISITING;
+      chain++;
+      j = (*s).inodes[j].parent;
+    }
+    int reached = (c->state[j] & CHECK_DONE) && (c->state[j] & CHECK_REACHED);     // a cycle meets a marked inode instead
+    for (int i = k; c->state[i] & CHECK_VISITING; i = (*s).inodes[i].parent) {
+      c->state[i] = (c->state[i] & ~CHECK_VISITING) | CHECK_DONE | (reached ? CHECK_REACHED : 0);
+      depth[i] = reached ? depth[j] + chain-- : 0;
+    }
+    c->state[k] |= CHECK_DONE;                     // one that stopped the chain at once is resolved without being marked
+  }
+}
+
+// counting the inodes the root does not reach and the entries missing or repeated in the directories it does
+void check_links (check_state * c) {
+  filesystem *s = c->s;
+  for (uint32_t k = 1; k < (*s).sb->total_inodes; k++) {
+    if ((*s).inodes[k].used == 0) {
+      continue;
+    }
+    if (!(c->state[k] & CHECK_REACHED)) {
+      if (!(c->state[k] & CHECK_BAD)) {
+        check_found(c, CHECK_ORPHAN, 1);
+        TRACE(TRACE_INFO, "the inode %d is not reached from the root \n", (int64_t)k);
+      }
+    } else if (c->links[k] != 1) {
+      check_found(c, CHECK_ENTRY, c->links[k] == 0 ? 1 : c->links[k] - 1);
+      c->state[(*s).inodes[k].parent] |= CHECK_REBUILD;
+    }
+  }
+}
+
+// rewriting the entries of directory d in the slots it has, one for each child the root reaches through it
+// missing starts the list of children with no entry, linked through next, and a child that loses a name clash or
+// does not fit is dropped, returns the number dropped
+int64_t check_rebuild (check_state * c, int d, int missing, int * next) {
+  filesystem *s = c->s;
+  if (dir_private(s, d) == -1) {
+    printf("No Space left to rewrite the entries of a directory a snapshot shares.\n");
+    return 0;
+  }
+  int hashed = (*s).sb->flags & FS_HASHED_DIRS;
+  int64_t capacity = dir_capacity(s, d), count = 0, cap = 0, kept = 0, dropped = 0;
+  check_name *names = NULL;
+  for (int64_t i = 0; i < capacity; i++) {
+    dirent *e = dir_slot(s, d, i);
+    if (e->namelen != 0 && check_entry(c, d, e)) {
+      check_name_add(&names, &count, &cap, e->inode, s);
+    }
+    memset(e, 0, sizeof(dirent));
+    mark_dirty(s, e, sizeof(dirent));
+  }
+  for (int k = missing; k != -1; k = next[k]) {
+    check_name_add(&names, &count, &cap, k, s);
+  }
+  qsort(names, count, sizeof(check_name), check_name_order);
+  for (int64_t i = 0; i < count; i++) {
+    int k = names[i].inode;
+    if (kept > 0 && names[kept - 1].inode == k) {
+      continue;                                    // the same inode entered twice
+    }
+    if ((kept > 0 && memcmp(names[kept - 1].name, names[i].name, FILENAME_MAXLEN) == 0) ||
+        (hashed ? kept + 1 >= capacity : kept + 1 > capacity)) {
+      c->state[k] |= CHECK_BAD;                    // the lowest inode keeps the name, and a hashed table keeps a free slot
+      dropped++;
+      continue;
+    }
+    names[kept++] = names[i];
+  }
+  for (int64_t i = 0; i < kept; i++) {
+    if (hashed) {
+      dir_hash_insert(s, d, names[i].inode);
+    } else {
+      dirent_set(dir_slot(s, d, i), names[i].inode, s);
+    }
+  }
+  (*s).inodes[d].entries = kept;
+  int per = dirents_per_block(s);
+  while (!hashed && (*s).inodes[d].blocks > (kept + per - 1) / per) {
+    free_last_block(s, d);                         // the blocks left empty at the end
+  }
+  inode_dirty(s, d);
+  free(names);
+  return dropped;
+}
+
+// fourth pass, the references to every block from the files in [first, end) that the root reaches
+void check_refs (check_state * c, uint64_t first, uint64_t end) {
+  for (uint64_t k = first; k < end; k++) {
+    if (c->state[k] & CHECK_REACHED) {
+      check_tree(c, &c->s->inodes[k], 1);
+    }
+  }
+}
+
+// the inodes of the snapshot being checked held by blocks [first, end) of its copy of the inode table
+void check_snapshot (check_state * c, uint64_t first, uint64_t end) {
+  filesystem *s = c->s;
+  uint32_t per = snapshot_per_block(s), total = (*s).sb->total_inodes;
+  uint32_t *run = snapshot_runs(c->snapshot);
+  for (uint64_t i = first; i < end; i++) {
+    uint64_t at = i;
+    uint32_t r = 0;
+    while (at >= run[2 * r + 1]) {
+      at -= run[2 * r + 1];
+      r++;
+    }
+    inode *copy = (inode *)block_at(s, run[2 * r] + at);
+    for (uint32_t j = 0; j < per && i * per + j < total; j++) {
+      if (copy[j].used != 0 && (copy[j].used != 1 || check_tree(c, &copy[j], c->counting) == -1)) {
+        c->damaged = 1;
+      }
+    }
+  }
+}
+
+// fifth pass, every snapshot has to list a whole copy of the inode table on the disk with every inode in it sound
+// before the blocks it reaches are counted, a damaged one is dropped by a repair, and what only it reached is freed
+void check_snapshots (check_state * c, int threads) {
+  filesystem *s = c->s;
+  uint32_t per = snapshot_per_block(s), table_blocks = ((*s).sb->total_inodes + per - 1) / per;
+  uint32_t most = ((*s).sb->block_size - sizeof(snapshot_header)) / (2 * sizeof(uint32_t));
+  for (int n = 0; n < MAX_SNAPSHOTS; n++) {
+    snapshot *snap = &(*s).sb->snapshots[n];
+    if (snap->header == 0) {
+      continue;
+    }
+    c->damaged = snap->header < (*s).sb->data_start || snap->header >= (*s).sb->total_blocks;
+    snapshot_header *h = c->damaged ? NULL : (snapshot_header *)block_at(s, snap->header);
+    uint32_t *run = c->damaged ? NULL : snapshot_runs(h);
+    if (!c->damaged) {
+      c->damaged = h->table_blocks != table_blocks || h->runs == 0 || h->runs > most;
+      uint64_t listed = 0;
+      for (uint32_t r = 0; !c->damaged && r < h->runs; r++) {
+        c->damaged = run[2 * r + 1] == 0 || run[2 * r] < (*s).sb->data_start ||
+                     (uint64_t)run[2 * r] + run[2 * r + 1] > (*s).sb->total_blocks;
+        listed += run[2 * r + 1];
+      }
+      c->damaged = c->damaged || listed != table_blocks;
+    }
+    if (!c->damaged) {
+      c->snapshot = h;
+      c->counting = 0;
+      check_parallel(c, threads, check_snapshot, table_blocks, CHECK_INODES / per);
+    }
+    if (c->damaged) {
+      check_found(c, CHECK_SNAPSHOT, 1);
+      TRACE(TRACE_INFO, "the snapshot %s is damaged \n", trace_name(snap->name));
+      if (c->repair) {
+        memset(snap, 0, sizeof(snapshot));
+        mark_dirty(s, snap, sizeof(snapshot));
+      }
+      continue;
+    }
+    check_ref(c, snap->header, 1, 1);
+    for (uint32_t r = 0; r < h->runs; r++) {
+      for (uint32_t i = 0; i < run[2 * r + 1]; i++) {
+        check_ref(c, run[2 * r] + i, 1, 1);
+      }
+    }
+    c->counting = 1;
+    check_parallel(c, threads, check_snapshot, table_blocks, CHECK_INODES / per);
+  }
+}
+
+// sixth pass, every entry of the dedup table has to name a full block some file reaches, hashed by its content
+// and found by probing from its hash, each block once, and then counts as one more reference to it
+// a repair drops the entries that are wrong and enters the rest again, so the table stays probed without gaps
+void check_dedup (check_state * c) {
+  filesystem *s = c->s;
+  if ((*s).dedup == NULL) {
+    return;
+  }
+  uint32_t mask = (*s).dedup_mask, bad = 0, kept = 0;
+  uint64_t *seen = calloc(((*s).sb->total_blocks + 63) / 64, sizeof(uint64_t));
+  dedup_entry *keep = malloc(((uint64_t)mask + 1) * sizeof(dedup_entry));
+  if (seen == NULL || keep == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (uint32_t i = 0; i <= mask; i++) {
+    dedup_entry e = (*s).dedup[i];
+    if (e.block == 0) {
+      continue;
+    }
+    int wrong = e.block < (*s).sb->data_start || e.block >= (*s).sb->total_blocks || c->refs[e.block] == 0 ||
+                ((seen[e.block / 64] >> (e.block % 64)) & 1) || e.hash != dedup_hash(block_at(s, e.block), (*s).sb->block_size);
+    for (uint32_t j = e.hash & mask; !wrong && j != i; j = (j + 1) & mask) {
+      wrong = (*s).dedup[j].block == 0;            // a lookup stops at the first empty slot
+    }
+    if (wrong) {
+      bad++;
+      continue;
+    }
+    seen[e.block / 64] |= (uint64_t)1 << (e.block % 64);
+    keep[kept++] = e;
+    check_ref(c, e.block, 1, 1);
+  }
+  if (bad > 0) {
+    check_found(c, CHECK_DEDUP, bad);
+    TRACE(TRACE_INFO, "%d entries of the dedup table are wrong \n", bad);
+    if (c->repair) {
+      memset((*s).dedup, 0, ((uint64_t)mask + 1) * sizeof(dedup_entry));
+      for (uint32_t n = 0; n < kept; n++) {
+        uint32_t i = keep[n].hash & mask;
+        while ((*s).dedup[i].block != 0) {
+          i = (i + 1) & mask;
+        }
+        (*s).dedup[i] = keep[n];
+      }
+      mark_dirty(s, (*s).dedup, ((uint64_t)mask + 1) * sizeof(dedup_entry));
+      dedup_reset(s);                              // the pinned bits from the table as it is now
+    }
+  }
+  free(seen);
+  free(keep);
+}
+
+// checking if len bytes of buf are all zero
+int check_zero (const char * buf, uint64_t len) {
+  for (uint64_t i = 0; i < len; i += sizeof(uint64_t)) {
+    if (*(const uint64_t *)(buf + i) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// counting free block b that does not read as zeroes, and clearing it
+void check_garbage (check_state * c, uint64_t b) {
+  check_found(c, CHECK_GARBAGE, 1);
+  if (c->repair) {
+    memset(block_at(c->s, b), 0, c->s->sb->block_size);
+    mark_dirty(c->s, block_at(c->s, b), c->s->sb->block_size);
+  }
+}
+
+// last pass, the blocks in [first, end), a whole number of bitmap words, against the references found
+// free blocks are read from the image file in runs, so the scan streams through the disk without filling the mapping
+void check_blocks (check_state * c, uint64_t first, uint64_t end) {
+  filesystem *s = c->s;
+  uint32_t bs = (*s).sb->block_size;
+  uint64_t *unread = calloc((end - first + 63) / 64, sizeof(uint64_t));     // free blocks still to be read
+  if (unread == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  uint64_t free_here = 0;
+  for (uint64_t b = first; b < end; b++) {
+    int used = ((*s).freeblocklist[b / 64] >> (b % 64)) & 1;
+    uint32_t refs = b < (*s).sb->data_start ? 1 : c->refs[b];       // the metadata is always in use and never shared
+    uint32_t shared = refs > 0 ? refs - 1 : 0;
+    if ((*s).refcounts[b] != shared) {
+      check_found(c, CHECK_REFCOUNT, 1);
+      if (c->repair) {
+        (*s).refcounts[b] = shared;
+        mark_dirty(s, &(*s).refcounts[b], sizeof(uint32_t));
+      }
+    }
+    if (refs > 0 && !used) {
+      check_found(c, CHECK_UNMARKED, 1);
+      if (c->repair) {
+        set_bit(s, b, 1);
+      }
+    } else if (refs == 0 && used) {
+      check_found(c, CHECK_LEAK, 1);
+      if (c->repair) {
+        memset(block_at(s, b), 0, bs);             // free blocks read as zeroes
+        mark_dirty(s, block_at(s, b), bs);
+        set_bit(s, b, 0);
+      }
+    } else if (refs == 0) {
+      if ((*s).dirty[b / 64] & ((uint64_t)1 << (b % 64))) {
+        if (!check_zero(block_at(s, b), bs)) {     // freed by the repair, so only the mapping has it
+          check_garbage(c, b);
+        }
+      } else {
+        unread[(b - first) / 64] |= (uint64_t)1 << ((b - first) % 64);
+      }
+    }
+    free_here += !(((*s).freeblocklist[b / 64] >> (b % 64)) & 1);      // as the bitmap has it once repaired
+  }
+
+  char *buf = NULL;
+  for (uint64_t b = first; b < end; b++) {
+    if (!(unread[(b - first) / 64] & ((uint64_t)1 << ((b - first) % 64)))) {
+      continue;
+    }
+    uint64_t run = 1;
+    while (b + run < end && (unread[(b + run - first) / 64] & ((uint64_t)1 << ((b + run - first) % 64)))) {
+      run++;
+    }
+    if (buf == NULL && (buf = malloc((end - first) * bs)) == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    if (pread((*s).fd, buf, run * bs, b * bs) != (ssize_t)(run * bs)) {
+      printf("Unable to read blocks %llu to %llu of the image.\n", (unsigned long long)b, (unsigned long long)(b + run - 1));
+    } else {
+      for (uint64_t i = 0; i < run; i++) {
+        if (!check_zero(buf + i * bs, bs)) {
+          check_garbage(c, b + i);
+        }
+      }
+    }
+    b += run - 1;
+  }
+  free(buf);
+  free(unread);
+  __atomic_add_fetch(&c->free_blocks, free_here, __ATOMIC_RELAXED);
+}
+
+// summing the sizes and counts of every directory from the bottom up, deepest inodes first, and comparing them
+// with what the directories hold, a file's size has to match the blocks it maps
+void check_sizes (check_state * c, uint32_t * depth) {
+  filesystem *s = c->s;
+  uint32_t total = (*s).sb->total_inodes, deepest = 0;
+  for (uint32_t k = 0; k < total; k++) {
+    if ((c->state[k] & CHECK_REACHED) && depth[k] > deepest) {
+      deepest = depth[k];
+    }
+  }
+  uint32_t *start = calloc(deepest + 2, sizeof(uint32_t));      // the inodes of each depth, sorted by counting
+  uint32_t *order = malloc(total * sizeof(uint32_t));
+  int64_t *size = calloc(total, sizeof(int64_t));
+  int *below = calloc(total, sizeof(int)), *entries = calloc(total, sizeof(int));
+  if (start == NULL || order == NULL || size == NULL || below == NULL || entries == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (uint32_t k = 0; k < total; k++) {
+    if (c->state[k] & CHECK_REACHED) {
+      start[depth[k] + 1]++;
+    }
+  }
+  for (uint32_t d = 0; d < deepest; d++) {
+    start[d + 1] += start[d];
+  }
+  for (uint32_t k = 0; k < total; k++) {
+    if (c->state[k] & CHECK_REACHED) {
+      order[start[depth[k]]++] = k;                // start[d] ends up where depth d + 1 begins
+    }
+  }
+  uint32_t bs = (*s).sb->block_size;
+  for (uint32_t i = start[deepest]; i-- > 0; ) {
+    uint32_t k = order[i];
+    inode *node = &(*s).inodes[k];
+    if (node->dir == 1 && (node->size != size[k] || node->below != below[k] || node->entries != entries[k])) {
+      check_found(c, CHECK_SIZE, 1);
+      if (c->repair) {
+        node->size = size[k];
+        node->below = below[k];
+        node->entries = entries[k];
+        inode_dirty(s, k);
+      }
+    } else if (node->dir == 0 && file_blocks(s, node->size) != node->blocks) {
+      check_found(c, CHECK_SIZE, 1);
+      if (c->repair) {
+        node->size = (int64_t)node->blocks * bs;   // the blocks it has are what it holds, nothing if it has none
+        memset(node->data, 0, INLINE_MAX);
+        inode_dirty(s, k);
+      }
+    }
+    if (k != 0) {
+      size[node->parent] += node->dir == 1 ? size[k] : node->size;
+      below[node->parent] += 1 + below[k];
+      entries[node->parent]++;
+    }
+  }
+  free(start);
+  free(order);
+  free(size);
+  free(below);
+  free(entries);
+}
+
+// checking the image mounted in s on the given number of threads and repairing it if repair is set
+// returns 0 if it is consistent or has been repaired, 1 if problems were found and -1 if it cannot be checked at all
+int check_image (filesystem * s, int threads, int repair) {
+  uint64_t start = now_ns();
+  uint32_t inodes = (*s).sb->total_inodes, blocks = (*s).sb->total_blocks;
+  check_state c = {.s = s, .repair = repair};
+  c.state = calloc(inodes, 1);
+  c.links = calloc(inodes, sizeof(uint32_t));
+  c.refs = calloc(blocks, sizeof(uint32_t));
+  uint32_t *depth = calloc(inodes, sizeof(uint32_t));
+  if (c.state == NULL || c.links == NULL || c.refs == NULL || depth == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+
+  if (((journal_header *)block_at(s, (*s).sb->journal_start))->magic == JOURNAL_MAGIC) {
+    check_found(&c, CHECK_JOURNAL, 1);             // mounting replays a complete one, so this one never committed
+    if (repair && journal_clear(s) == -1) {
+      perror("Unable to clear the journal");
+    }
+  }
+  check_parallel(&c, threads, check_inodes, inodes, CHECK_INODES);
+  if ((*s).inodes[0].used != 1 || (c.state[0] & CHECK_BAD)) {
+    printf("The root directory is damaged, nothing on the disk can be reached.\n");
+    free(c.state);
+    free(c.links);
+    free(c.refs);
+    free(depth);
+    return -1;
+  }
+  check_parallel(&c, threads, check_dirs, inodes, CHECK_INODES);
+  check_reach(&c, depth);
+  check_links(&c);
+  if (repair) {
+    int *missing = malloc(inodes * sizeof(int)), *next = malloc(inodes * sizeof(int));     // children with no entry, by parent
+    if (missing == NULL || next == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    memset(missing, 0xff, inodes * sizeof(int));
+    for (uint32_t k = 1; k < inodes; k++) {
+      if ((c.state[k] & CHECK_REACHED) && c.links[k] == 0) {
+        next[k] = missing[(*s).inodes[k].parent];
+        missing[(*s).inodes[k].parent] = k;
+      }
+    }
+    int64_t dropped = 0;
+    for (uint32_t d = 0; d < inodes; d++) {
+      if ((c.state[d] & (CHECK_REACHED | CHECK_REBUILD)) == (CHECK_REACHED | CHECK_REBUILD)) {
+        dropped += check_rebuild(&c, d, missing[d], next);
+      }
+    }
+    if (dropped > 0) {
+      check_reach(&c, depth);                      // what was below a dropped entry is no longer reached
+    }
+    for (uint32_t k = 1; k < inodes; k++) {
+      if ((*s).inodes[k].used != 0 && !(c.state[k] & CHECK_REACHED)) {
+        check_clear(s, k);                         // its blocks are freed below unless a file that stays reaches them
+      }
+    }
+    free(missing);
+    free(next);
+  }
+  check_parallel(&c, threads, check_refs, inodes, CHECK_INODES);
+  check_snapshots(&c, threads);
+  check_dedup(&c);
+  check_parallel(&c, threads, check_blocks, blocks, CHECK_BYTES / (*s).sb->block_size);
+  check_sizes(&c, depth);
+
+  uint32_t used = 0;
+  for (uint32_t k = 0; k < inodes; k++) {
+    used += (*s).inodes[k].used != 0;
+  }
+  for (uint64_t b = blocks; b < ((uint64_t)blocks + 63) / 64 * 64; b++) {
+    if (!(((*s).freeblocklist[b / 64] >> (b % 64)) & 1)) {
+      check_found(&c, CHECK_UNMARKED, 1);          // past the end of the disk, so never to be handed out
+      if (repair) {
+        set_bit(s, b, 1);
+      }
+    }
+  }
+  if ((*s).sb->free_blocks != c.free_blocks || (*s).sb->free_inodes != inodes - used) {
+    check_found(&c, CHECK_COUNTS, ((*s).sb->free_blocks != c.free_blocks) + ((*s).sb->free_inodes != inodes - used));
+    if (repair) {
+      (*s).sb->free_blocks = c.free_blocks;
+      (*s).sb->free_inodes = inodes - used;
+      mark_dirty(s, (*s).sb, sizeof(superblock));
+    }
+  }
+
+  uint64_t problems = 0;
+  for (int i = 0; i < CHECK_KINDS; i++) {
+    if (c.problems[i] > 0) {
+      printf("%llu %s%s \n", (unsigned long long)c.problems[i], check_messages[i], repair ? ", repaired" : "");
+      problems += c.problems[i];
+    }
+  }
+  printf("Checked %u inodes and %u blocks on %d thread%s in %.1f ms, %s \n", inodes, blocks, threads, threads == 1 ? "" : "s",
+         (now_ns() - start) / 1e6, problems == 0 ? "the disk is consistent" : repair ? "the disk has been repaired" : "the disk needs repair");
+  free(c.state);
+  free(c.links);
+  free(c.refs);
+  free(depth);
+  return problems == 0 || repair ? 0 : 1;
+}
+
+// benchmark
+// each workload is generated as a trace of commands, then replayed on a freshly formatted disk
+// every command is timed on its own and the results are printed as JSON, one entry per command type
+
+// a growing buffer of generated commands
+typedef struct trace_text {
+  char * text;
+  size_t len;
+  size_t cap;
+} trace_text;
+
+// appending one command to a generated trace
+void emit (trace_text * t, const char * fmt, ...) {
+  if (t->cap - t->len < 256) {
+    t->cap = t->cap ? t->cap * 2 : 1 << 20;
+    t->text = realloc(t->text, t->cap);
+    if (t->text == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  t->len += vsnprintf(t->text + t->len, t->cap - t->len, fmt, ap);
+  va_end(ap);
+}
+
+// the workload generators share one seeded generator, so every run replays the same traces
+uint64_t bench_seed;
+
+uint32_t bench_rand () {
+  bench_seed ^= bench_seed << 13;              // xorshift64
+  bench_seed ^= bench_seed >> 7;
+  bench_seed ^= bench_seed << 17;
+  return bench_seed >> 32;
+}
+
+// one wide directory, filled with empty files and then emptied
+void gen_wide (trace_text * t, int ops) {
+  emit(t, "CD /w\n");
+  for (int f = 0; f < ops / 2; f++) {
+    emit(t, "CR /w/f%d 0\n", f);
+  }
+  for (int f = 0; f < ops / 2; f++) {
+    emit(t, "DL /w/f%d\n", f);
+  }
+}
+
+// files created and deleted at the bottom of a path 60 directories deep
+void gen_deep (trace_text * t, int ops) {
+  char path[4 * 60 + 1] = "";
+  for (int d = 0; d < 60; d++) {
+    sprintf(path + strlen(path), "/d%d", d % 10);
+    emit(t, "CD %s\n", path);
+  }
+  for (int n = 0; n < ops / 2; n++) {
+    emit(t, "CR %s/f%d 100\n", path, n % 64);
+    emit(t, "DL %s/f%d\n", path, n % 64);
+  }
+}
+
+// random creates and deletes of small files across 64 directories
+void gen_churn (trace_text * t, int ops) {
+  static unsigned char exists[64][1024];
+  memset(exists, 0, sizeof(exists));
+  for (int d = 0; d < 64; d++) {
+    emit(t, "CD /c%d\n", d);
+  }
+  for (int n = 0; n < ops; n++) {
+    int d = bench_rand() % 64, f = bench_rand() % 1024;
+    if (exists[d][f]) {
+      emit(t, "DL /c%d/f%d\n", d, f);
+    } else {
+      emit(t, "CR /c%d/f%d %u\n", d, f, bench_rand() % 4096);
+    }
+    exists[d][f] ^= 1;
+  }
+}
+
+// many copies of a few source files, the oldest copies deleted to make room
+void gen_copy (trace_text * t, int ops) {
+  emit(t, "CD /src\n");
+  emit(t, "CD /dst\n");
+  for (int f = 0; f < 64; f++) {
+    emit(t, "CR /src/s%d %u\n", f, bench_rand() % 16384);
+  }
+  for (int n = 0; n < ops; n++) {
+    if (n >= 1024) {
+      emit(t, "DL /dst/c%d\n", n - 1024);      // keeping the last 1024 copies
+    }
+    emit(t, "CP /src/s%u /dst/c%d\n", bench_rand() % 64, n);
+  }
+}
+
+// every command type, on files and scratch directories spread over 16 directories
+void gen_mixed (trace_text * t, int ops) {
+  static unsigned char exists[16][256];
+  static unsigned char scratch[16];
+  memset(exists, 0, sizeof(exists));
+  memset(scratch, 0, sizeof(scratch));
+  for (int d = 0; d < 16; d++) {
+    emit(t, "CD /m%d\n", d);
+  }
+  for (int n = 0; n < ops; n++) {
+    int d = bench_rand() % 16, f = bench_rand() % 256, pick = bench_rand() % 100;
+    if (pick < 10) {
+      emit(t, scratch[d] ? "DD /m%d/t\n" : "CD /m%d/t\n", d);     // scratch directories come and go
+      scratch[d] ^= 1;
+    } else if (!exists[d][f]) {
+      emit(t, "CR /m%d/f%d %u\n", d, f, bench_rand() % 8192);
+      exists[d][f] = 1;
+    } else if (pick < 45) {
+      emit(t, "DL /m%d/f%d\n", d, f);
+      exists[d][f] = 0;
+    } else {
+      int d2 = bench_rand() % 16;
+      if (exists[d2][f]) {
+        emit(t, "DL /m%d/f%d\n", d2, f);       // making room at the destination
+        exists[d2][f] = 0;
+      } else if (pick < 70) {
+        emit(t, "CP /m%d/f%d /m%d/f%d\n", d, f, d2, f);
+        exists[d2][f] = 1;
+      } else {
+        emit(t, "MV /m%d/f%d /m%d/f%d\n", d, f, d2, f);
+        exists[d][f] = 0;
+        exists[d2][f] = 1;
+      }
+    }
+  }
+}
+
+// large files written and deleted in one directory, a tenth of the commands creating 1 MB each
+void gen_large (trace_text * t, int ops) {
+  emit(t, "CD /l\n");
+  for (int n = 0; n < ops / 10; n++) {
+    if (n >= 64) {
+      emit(t, "DL /l/f%d\n", n - 64);        // keeping the last 64 files
+    }
+    emit(t, "CR /l/f%d 1048576\n", n);
+  }
+}
+
+// a workload of the benchmark
+typedef struct workload {
+  const char * name;
+  void (*generate) (trace_text * t, int ops);
+} workload;
+
+workload workloads[] = {
+  {"wide", gen_wide},
+  {"deep", gen_deep},
+  {"churn", gen_churn},
+  {"copy", gen_copy},
+  {"mixed", gen_mixed},
+  {"large", gen_large},
+};
+
+// ordering latencies for qsort
+int compare_latency (const void * a, const void * b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// latencies of one command type in a workload
+typedef struct latencies {
+  uint64_t * ns;
+  size_t count;
+  size_t cap;
+} latencies;
+
+// running the workloads named in list, or all of them, with ops commands each, returns -1 if the disk could not be set up
+int bench (const char * list, int ops, const char * image, uint32_t inodes, uint32_t block_size, uint64_t disk_size, uint32_t flags) {
+  enum { NCOMMANDS = sizeof(commands) / sizeof(commands[0]) };
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);       // the commands print to a null stdout while they are timed
+  int null = open("/dev/null", O_WRONLY);
+  printf("{\"geometry\": {\"inodes\": %u, \"block_size\": %u, \"disk_size\": %llu, \"hashed_dirs\": %s, \"dedup\": %s}, \"ops\": %d, \"workloads\": [",
+         inodes, block_size, (unsigned long long)disk_size, (flags & FS_HASHED_DIRS) ? "true" : "false",
+         (flags & FS_DEDUP) ? "true" : "false", ops);
+  int first = 1;
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    if (strcmp(list, "all") != 0 && strstr(list, workloads[w].name) == NULL) {
+      continue;
+    }
+    trace_text t = {0};
+    bench_seed = 0x9e3779b97f4a7c15ULL;
+    workloads[w].generate(&t, ops);
+
+    filesystem fs = {0};
+    if (create_image(&fs, image, inodes, block_size, disk_size, flags) == -1) {
+      free(t.text);
+      return -1;
+    }
+    createdirectory("/", &fs);
+
+    latencies lat[NCOMMANDS] = {{0}};
+    uint64_t lines = 0, failed = 0;
+    uint64_t written = my_stats->bytes_written;
+    fflush(stdout);
+    dup2(null, STDOUT_FILENO);
+    uint64_t start = now_ns();
+    for (char *line = t.text, *nl; (nl = memchr(line, '\n', t.text + t.len - line)) != NULL; line = nl + 1) {
+      *nl = '\0';
+      size_t c = 0;
+      while (c < NCOMMANDS && strncmp(line, commands[c].name, 2) != 0) {
+        c++;                                   // the generators only write known commands
+      }
+      uint64_t before = now_ns();
+      int status = run_line(line, &fs);
+      uint64_t took = now_ns() - before;
+      lines++;
+      failed += status != FS_OK;
+      latencies *l = &lat[c < NCOMMANDS ? c : 0];
+      if (l->count == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 4096;
+        l->ns = realloc(l->ns, l->cap * sizeof(uint64_t));
+        if (l->ns == NULL) {
+          perror("realloc");
+          exit(1);
+        }
+      }
+      l->ns[l->count++] = took;
+    }
+    uint64_t run_ns = now_ns() - start;
+    written = my_stats->bytes_written - written;
+    uint64_t blocks_used = fs.sb->total_blocks - fs.sb->data_start - fs.sb->free_blocks;     // data and index blocks left in use
+    uint64_t sync_start = now_ns();
+    int status = unmount_image(&fs);           // the write back is timed on its own
+    uint64_t sync_ns = now_ns() - sync_start;
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+
+    printf("%s\n  {\"name\": \"%s\", \"commands\": %llu, \"failed\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, \"written_mb_per_sec\": %.1f, \"sync_seconds\": %.6f, \"blocks_used\": %llu%s, \"by_command\": {",
+           first ? "" : ",", workloads[w].name, (unsigned long long)lines, (unsigned long long)failed,
+           run_ns / 1e9, lines / (run_ns / 1e9), written / 1048576.0 / (run_ns / 1e9), sync_ns / 1e9, (unsigned long long)blocks_used,
+           status == -1 ? ", \"sync_failed\": true" : "");
+    first = 0;
+    int first_command = 1;
+    for (size_t c = 0; c < NCOMMANDS; c++) {
+      latencies *l = &lat[c];
+      if (l->count == 0) {
+        continue;
+      }
+      uint64_t total = 0;
+      for (size_t n = 0; n < l->count; n++) {
+        total += l->ns[n];
+      }
+      qsort(l->ns, l->count, sizeof(uint64_t), compare_latency);
+      printf("%s\n    \"%s\": {\"ops\": %zu, \"ops_per_sec\": %.0f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f, \"max_us\": %.3f}",
+             first_command ? "" : ",", commands[c].name, l->count, l->count / (total / 1e9),
+             l->ns[l->count / 2] / 1e3, l->ns[l->count * 99 / 100] / 1e3, l->ns[l->count * 999 / 1000] / 1e3, l->ns[l->count - 1] / 1e3);
+      first_command = 0;
+      free(l->ns);
+    }
+    printf("}}");
+    free(t.text);
+  }
+  printf("\n]}\n");
+  close(null);
+  close(saved_stdout);
+  unlink(image);
+  return 0;
+}
+
+// writing the statistics to the file at path, or to stdout when it is "-", nothing if path is NULL
+void write_stats (const char * path) {
+  if (path == NULL) {
+    return;
+  }
+  FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  if (out == NULL) {
+    perror("Unable to write the statistics");
+    return;
+  }
+  stats_dump(out);
+  if (out != stdout) {
+    fclose(out);
+  }
+}
+
+// main
+int main (int argc, char* argv[]) {
+  const char *filename = "my_fs.txt";            // the disk image
+  int format_new = 0;                            // formatting a new image instead of mounting the existing one
+  uint32_t inodes = DEFAULT_INODES;              // geometry used when formatting the disk
+  uint32_t block_size = DEFAULT_BLOCK_SIZE;
+  uint64_t disk_size = DEFAULT_DISK_SIZE;
+  uint32_t flags = 0;
+  const char *socket_path = NULL;                // serving the commands over this socket instead of reading them
+  const char *bench_list = NULL;                 // running these benchmark workloads instead
+  int bench_ops = BENCH_OPS;
+  int geometry_set = 0;
+  const char *stats_path = NULL;                 // where the statistics go at exit, "-" for stdout
+  int workers = 0;                               // threads replaying the commands or checking the image, 0 until -j
+  int check = 0;                                 // checking the image instead, 2 to repair it as well
+  uint32_t group_commit = 0;                     // commands per transaction
+  uint64_t cache_size = 0;                       // bytes of data kept resident, 0 for no limit
+  int opt;
+  while ((opt = getopt(argc, argv, "i:fn:b:s:HDS:vB:c:M:j:g:C:kK")) != -1) {
+    switch (opt) {
+      case 'i': filename = optarg; break;                        // image file
+      case 'f': format_new = 1; break;                           // format before running the commands
+      case 'n': inodes = size_option(opt, optarg, UINT32_MAX); geometry_set |= 1; break;     // number of inodes
+      case 'b': block_size = size_option(opt, optarg, UINT32_MAX); break;      // bytes per block
+      case 's': disk_size = size_option(opt, optarg, INT64_MAX); geometry_set |= 2; break;     // total size of the disk
+      case 'H': flags |= FS_HASHED_DIRS; break;                 // hashed directories
+      case 'D': flags |= FS_DEDUP; break;                        // deduplicated blocks
+      case 'S': socket_path = optarg; break;                     // server mode
+      case 'v': trace_verbosity++; break;                        // tracing
+      case 'B': bench_list = optarg; break;                      // benchmark
+      case 'c': bench_ops = atoi(optarg); break;                 // commands per workload
+      case 'M': stats_path = optarg; break;                      // statistics dump
+      case 'j': workers = atoi(optarg); break;                   // parallel replay
+      case 'g': group_commit = strtoul(optarg, NULL, 10); break;  // group commit
+      case 'C': cache_size = size_option(opt, optarg, INT64_MAX); break;       // block cache capacity
+      case 'k': check = 1; break;                                // consistency check
+      case 'K': check = 2; break;                                // and repair
+      default:
+        fprintf(stderr, "usage: %s [-v] [-M stats] [-i image] [-f [-n inodes] [-b block size] [-s disk size] [-H] [-D]] [-g commands] [-C cache size] [-S socket | [-j threads] commands | -]\n"
+                        "       %s [-i image] -k|-K [-j threads]\n"
+                        "       %s -B all|wide,deep,churn,copy,mixed,large [-c commands] [-n inodes] [-b block size] [-s disk size] [-H] [-D]\n", argv[0], argv[0], argv[0]);
+        return 1;
+    }
+  }
+  if (check) {
+    int threads = workers > 0 ? workers : (int)sysconf(_SC_NPROCESSORS_ONLN);     // every core unless -j says otherwise
+    threads = threads < 1 ? 1 : threads > MAX_WORKERS ? MAX_WORKERS : threads;
+    filesystem fs = {0};
+    if (mount_image(&fs, filename) == -1) {
+      return 1;
+    }
+    int status = check_image(&fs, threads, check == 2);
+    if (check == 2) {
+      status = unmount_image(&fs) == -1 ? -1 : status;      // the repairs go out as one transaction
+    } else {
+      release_image(&fs);                          // a check writes nothing
+    }
+    trace_dump(stdout);
+    return status == 0 ? 0 : 1;
+  }
+  if (workers < 1 || workers > MAX_WORKERS) {
+    workers = workers < 1 ? 1 : MAX_WORKERS;
+  }
+  if (trace_verbosity > TRACE_LEVEL) {
+    fprintf(stderr, "Tracing above level %d is not compiled in, build with make debug.\n", TRACE_LEVEL);
   }
 
-  // writing datablock
-  for (int c = 0; c < 127; c++) {
-    if (fwrite(d_block[c]->index, 1024, 1, file) != 1) {
-      perror("Unable to write data to the file.\n");        // in case of failure
-      fclose(file);
+  if (bench_list != NULL) {
+    return bench(bench_list, bench_ops, strcmp(filename, "my_fs.txt") == 0 ? BENCH_IMAGE : filename,
+                 (geometry_set & 1) ? inodes : BENCH_INODES, block_size,
+                 (geometry_set & 2) ? disk_size : BENCH_DISK_SIZE, flags) == -1 ? 1 : 0;
+  }
+
+  filesystem fs = {0};
+  filesystem * s_block = &fs;
+  if (format_new) {
+    if (create_image(s_block, filename, inodes, block_size, disk_size, flags) == -1) {   // setting the initial values of super block and data blocks
       return 1;
     }
+    createdirectory("/", s_block);   // creating root directory before reading any command
+  } else if (mount_image(s_block, filename) == -1) {
+    printf("Format a new disk with -f.\n");
+    return 1;
+  }
+  (*s_block).group_commit = group_commit;
+  cache_limit(s_block, cache_size);
+
+  if (socket_path != NULL) {
+    int status = serve(socket_path, s_block);
+    status = (unmount_image(s_block) == -1 || status == -1) ? 1 : 0;
+    trace_dump(stdout);
+    write_stats(stats_path);
+    return status;
   }
 
-  // closing both files
-  fclose(file);
-  fclose(stream);
+  // the commands come from the file named after the options, or from stdin when it is "-"
+  const char *input = optind < argc ? argv[optind] : "sampleinput.txt";
+  int in = strcmp(input, "-") == 0 ? STDIN_FILENO : open(input, O_RDONLY);
+  if (in == -1) {
+    perror("Unable to open the commands");
+    unmount_image(s_block);
+    return 1;
+  }
+  int64_t failed = workers > 1 ? run_parallel(in, s_block, workers) : run_batch(in, s_block);
+  if (in != STDIN_FILENO) {
+    close(in);
+  }
 
-  // to free the memory allocated on heap
-  free (buffer);
-  free (disk);   
-	return 0;
+  // the commands only changed the private mapping, so the dirty blocks are written back to the file here
+  int status = (unmount_image(s_block) == -1 || failed != 0) ? 1 : 0;     // any command that failed fails the run too
+  trace_dump(stdout);            // the trace is printed once the commands have run, so it never slows them down
+  write_stats(stats_path);
+	return status;
 }